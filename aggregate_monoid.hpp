@@ -0,0 +1,78 @@
+#ifndef _AGGREGATE_MONOID_HPP
+#define _AGGREGATE_MONOID_HPP
+
+#include <limits>
+#include <algorithm>
+
+// A monoid augments every node with the aggregate of its subtree.
+// It provides
+//     typedef ... Type;
+//     static Type Identity();
+//     static Type Lift(const Key& key, const T& value);// aggregate of a single element
+//     static Type Combine(const Type& left, const Type& right);// must be associative
+// Combine is always applied in key order, so it need not be commutative.
+
+// no augmentation; nodes carry no aggregate at all
+struct NoAggregate
+{
+    struct Type {};
+    static Type Identity() { return Type(); }
+    template <class Key, class T>
+    static Type Lift(const Key&, const T&) { return Type(); }
+    static Type Combine(const Type&, const Type&) { return Type(); }
+};
+
+struct CountAggregate
+{
+    typedef std::size_t Type;
+    static Type Identity() { return 0; }
+    template <class Key, class T>
+    static Type Lift(const Key&, const T&) { return 1; }
+    static Type Combine(const Type& left, const Type& right) { return left + right; }
+};
+
+template <class V>
+struct SumAggregate
+{
+    typedef V Type;
+    static Type Identity() { return Type(); }
+    template <class Key, class T>
+    static Type Lift(const Key&, const T& value) { return value; }
+    static Type Combine(const Type& left, const Type& right) { return left + right; }
+};
+
+template <class V>
+struct MinAggregate
+{
+    typedef V Type;
+    static Type Identity() { return std::numeric_limits<V>::max(); }
+    template <class Key, class T>
+    static Type Lift(const Key&, const T& value) { return value; }
+    static Type Combine(const Type& left, const Type& right) { return std::min(left, right); }
+};
+
+template <class V>
+struct MaxAggregate
+{
+    typedef V Type;
+    static Type Identity() { return std::numeric_limits<V>::lowest(); }
+    template <class Key, class T>
+    static Type Lift(const Key&, const T& value) { return value; }
+    static Type Combine(const Type& left, const Type& right) { return std::max(left, right); }
+};
+
+// base of a node holding the aggregate of its subtree
+template <class Monoid>
+struct AggregateStorage
+{
+    typename Monoid::Type aggregate;
+    AggregateStorage() : aggregate(Monoid::Identity()) {}
+};
+
+// empty base, so that nodes without augmentation do not grow
+template <>
+struct AggregateStorage<NoAggregate>
+{
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef _COLUMN_SCAN_HPP
+#define _COLUMN_SCAN_HPP
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+// ---------- declaration ----------
+
+// count, sum, minimum and maximum of the values whose entry in a filter column
+// (the keys, or the values themselves) lies in [lower, upper), over the columns
+// PersistentRedBlackTree::ExportColumns produces, added chunk by chunk. The loop is
+// branchless with a fixed trip count per block and an accumulator per lane, so the
+// compiler can vectorize it for arithmetic types. Sum is the type sums are kept in,
+// as in SumAggregate; an empty selection has the identities of MinAggregate/MaxAggregate.
+template <class F, class V, class Sum = V>
+class ColumnAggregate
+{
+public:
+    static constexpr int kBlockSize = 16;
+
+    ColumnAggregate(const F& lower, const F& upper);
+    void Add(const F* filter_column, const V* values, std::size_t size);
+    std::size_t count() const;
+    Sum sum() const;
+    V min() const;
+    V max() const;
+
+private:
+    static_assert(std::is_arithmetic<F>::value && std::is_arithmetic<V>::value,
+        "ColumnAggregate is for arithmetic columns");
+    void AddOne(int lane, const F& filter, const V& value);
+    F lower_;
+    F upper_;
+    std::size_t counts_[kBlockSize];
+    Sum sums_[kBlockSize];
+    V mins_[kBlockSize];
+    V maxs_[kBlockSize];
+};
+
+// append the positions i of column with lower <= column[i] < upper to selection;
+// a position is always written and kept only if it matches, so there is no branch
+// to mispredict on a selective filter
+template <class F>
+void SelectInRange(const F* column, std::size_t size, const F& lower, const F& upper,
+    std::vector<std::size_t>& selection);
+
+// ---------- definition ----------
+
+template <class F, class V, class Sum>
+constexpr int ColumnAggregate<F, V, Sum>::kBlockSize;
+
+template <class F, class V, class Sum>
+ColumnAggregate<F, V, Sum>::ColumnAggregate(const F& lower, const F& upper)
+    : lower_(lower), upper_(upper)
+{
+    int lane;
+    for (lane = 0; lane < kBlockSize; ++lane)
+    {
+        counts_[lane] = 0;
+        sums_[lane] = Sum();
+        mins_[lane] = std::numeric_limits<V>::max();
+        maxs_[lane] = std::numeric_limits<V>::lowest();
+    }
+}
+
+template <class F, class V, class Sum>
+inline void ColumnAggregate<F, V, Sum>::AddOne(int lane, const F& filter, const V& value)
+{
+    bool selected;
+    selected = !(filter < lower_) & (filter < upper_);
+    counts_[lane] += selected;
+    sums_[lane] += selected ? Sum(value) : Sum();
+    mins_[lane] = std::min(mins_[lane], selected ? value : std::numeric_limits<V>::max());
+    maxs_[lane] = std::max(maxs_[lane], selected ? value : std::numeric_limits<V>::lowest());
+}
+
+template <class F, class V, class Sum>
+void ColumnAggregate<F, V, Sum>::Add(const F* filter_column, const V* values, std::size_t size)
+{
+    std::size_t i;
+    int lane;
+    for (i = 0; i + kBlockSize <= size; i += kBlockSize)
+    {
+        for (lane = 0; lane < kBlockSize; ++lane)
+            AddOne(lane, filter_column[i + lane], values[i + lane]);
+    }
+    for (lane = 0; i < size; ++i, ++lane) AddOne(lane, filter_column[i], values[i]);
+}
+
+template <class F, class V, class Sum>
+std::size_t ColumnAggregate<F, V, Sum>::count() const
+{
+    std::size_t count;
+    int lane;
+    count = 0;
+    for (lane = 0; lane < kBlockSize; ++lane) count += counts_[lane];
+    return count;
+}
+
+template <class F, class V, class Sum>
+Sum ColumnAggregate<F, V, Sum>::sum() const
+{
+    Sum sum;
+    int lane;
+    sum = Sum();
+    for (lane = 0; lane < kBlockSize; ++lane) sum += sums_[lane];
+    return sum;
+}
+
+template <class F, class V, class Sum>
+V ColumnAggregate<F, V, Sum>::min() const
+{
+    return *std::min_element(mins_, mins_ + kBlockSize);
+}
+
+template <class F, class V, class Sum>
+V ColumnAggregate<F, V, Sum>::max() const
+{
+    return *std::max_element(maxs_, maxs_ + kBlockSize);
+}
+
+template <class F>
+void SelectInRange(const F* column, std::size_t size, const F& lower, const F& upper,
+    std::vector<std::size_t>& selection)
+{
+    std::size_t i, selected_num;
+    selected_num = selection.size();
+    selection.resize(selected_num + size);
+    for (i = 0; i < size; ++i)
+    {
+        selection[selected_num] = i;
+        selected_num += !(column[i] < lower) & (column[i] < upper);
+    }
+    selection.resize(selected_num);
+}
+
+#endif
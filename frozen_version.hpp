@@ -0,0 +1,161 @@
+#ifndef _FROZEN_VERSION_HPP
+#define _FROZEN_VERSION_HPP
+
+#include <utility>
+#include <stdexcept>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// number of keys in a block which are less than key; branchless with a fixed
+// trip count, so the compiler can vectorize it for arithmetic keys
+template <class Key, int kBlockSize>
+struct FrozenBlockRank
+{
+    static int Rank(const Key* block, const Key& key)
+    {
+        int rank, i;
+        rank = 0;
+        for (i = 0; i < kBlockSize; ++i)
+            rank += block[i] < key;
+        return rank;
+    }
+};
+
+#if defined(__SSE2__)
+template <>
+struct FrozenBlockRank<int, 16>
+{
+    static int Rank(const int* block, const int& key)
+    {
+        __m128i key_vector, rank_vector;
+        int i;
+        key_vector = _mm_set1_epi32(key);
+        rank_vector = _mm_setzero_si128();
+        // each lane where block < key is -1
+        for (i = 0; i < 16; i += 4)
+            rank_vector = _mm_sub_epi32(rank_vector, _mm_cmpgt_epi32(key_vector,
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i))));
+        rank_vector = _mm_add_epi32(rank_vector, _mm_shuffle_epi32(rank_vector, _MM_SHUFFLE(1, 0, 3, 2)));
+        rank_vector = _mm_add_epi32(rank_vector, _mm_shuffle_epi32(rank_vector, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(rank_vector);
+    }
+};
+#endif
+
+// ---------- declaration ----------
+
+// immutable copy of one version laid out for reading: the keys form an
+// implicit static B-tree whose blocks are one cache line each (block k has
+// children k * (kBlockSize + 1) + 1 ... k * (kBlockSize + 1) + kBlockSize + 1),
+// and the values are stored in sorted order for scans
+template <class Key, class T>
+class FrozenVersion
+{
+public:
+    typedef std::pair<const Key, T> ValueType;
+    typedef const ValueType* ConstIterator;
+    static constexpr int kBlockSize = 64 / sizeof(Key) > 2 ? 64 / sizeof(Key) : 2;
+
+    FrozenVersion() {}
+    // sorted_values must be sorted by key without duplicates
+    explicit FrozenVersion(std::vector<ValueType> sorted_values);
+    ConstIterator Find(const Key& key) const;
+    ConstIterator LowerBound(const Key& key) const;
+    const T& At(const Key& key) const;
+    ConstIterator CBegin() const { return values_.data(); }
+    ConstIterator CEnd() const { return values_.data() + values_.size(); }
+    std::size_t Size() const { return values_.size(); }
+
+#ifdef PRBT_TESTING
+protected:
+#else
+private:
+#endif
+    void BuildBlock(std::size_t block, std::size_t& next_rank);
+    std::vector<ValueType> values_;// sorted
+    std::vector<Key> keys_;// static B-tree; slots past the last key repeat the maximum key
+    std::vector<std::size_t> ranks_;// position in values_ of each slot of keys_
+};
+
+// ---------- definition ----------
+
+template <class Key, class T>
+constexpr int FrozenVersion<Key, T>::kBlockSize;
+
+template <class Key, class T>
+FrozenVersion<Key, T>::FrozenVersion(std::vector<ValueType> sorted_values)
+    : values_(std::move(sorted_values))
+{
+    std::size_t block_num, next_rank;
+    block_num = (values_.size() + kBlockSize - 1) / kBlockSize;
+    keys_.resize(block_num * kBlockSize);
+    ranks_.resize(block_num * kBlockSize);
+    next_rank = 0;
+    BuildBlock(0, next_rank);
+}
+
+// fill the subtree of block in order
+template <class Key, class T>
+void FrozenVersion<Key, T>::BuildBlock(std::size_t block, std::size_t& next_rank)
+{
+    std::size_t slot;
+    int i;
+    if (block * kBlockSize >= keys_.size()) return;
+    for (i = 0; i < kBlockSize; ++i)
+    {
+        BuildBlock(block * (kBlockSize + 1) + i + 1, next_rank);
+        slot = block * kBlockSize + i;
+        if (next_rank < values_.size())
+        {
+            keys_[slot] = values_[next_rank].first;
+            ranks_[slot] = next_rank++;
+        }
+        else
+        {
+            // padding; never less than a key being searched unless it exceeds all keys
+            keys_[slot] = values_.back().first;
+            ranks_[slot] = values_.size();
+        }
+    }
+    BuildBlock(block * (kBlockSize + 1) + kBlockSize + 1, next_rank);
+}
+
+template <class Key, class T>
+typename FrozenVersion<Key, T>::ConstIterator FrozenVersion<Key, T>::LowerBound(const Key& key) const
+{
+    std::size_t block, block_num, rank;
+    int block_rank;
+    block_num = keys_.size() / kBlockSize;
+    block = 0;
+    rank = values_.size();
+    while (block < block_num)
+    {
+        block_rank = FrozenBlockRank<Key, kBlockSize>::Rank(keys_.data() + block * kBlockSize, key);
+        // the candidate deeper in the tree is always the smaller one
+        if (block_rank < kBlockSize) rank = ranks_[block * kBlockSize + block_rank];
+        block = block * (kBlockSize + 1) + block_rank + 1;
+    }
+    return values_.data() + rank;
+}
+
+template <class Key, class T>
+typename FrozenVersion<Key, T>::ConstIterator FrozenVersion<Key, T>::Find(const Key& key) const
+{
+    ConstIterator it;
+    it = LowerBound(key);
+    if (it != CEnd() && it->first == key) return it;
+    return CEnd();
+}
+
+template <class Key, class T>
+const T& FrozenVersion<Key, T>::At(const Key& key) const
+{
+    ConstIterator it;
+    it = Find(key);
+    if (it == CEnd()) throw std::out_of_range("the container does not have an element with the specified key");
+    return it->second;
+}
+
+#endif
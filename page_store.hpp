@@ -0,0 +1,263 @@
+#ifndef _PAGE_STORE_HPP
+#define _PAGE_STORE_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+
+typedef std::uint64_t PageId;
+
+// ---------- declaration ----------
+
+// fixed-size pages of a file; freed pages are reused before the file grows
+class PageFile
+{
+public:
+    // creates the file at path, or truncates it
+    PageFile(const std::string& path, std::size_t page_size);
+    ~PageFile();
+    PageFile(const PageFile&) = delete;
+    PageFile& operator=(const PageFile&) = delete;
+    std::size_t page_size() const { return page_size_; }
+    // pages in the file, free ones included
+    std::size_t page_num() const { return page_num_; }
+    PageId Allocate();
+    void Free(PageId page);
+    // a page never written reads as zeros
+    void Read(PageId page, char* out);
+    void Write(PageId page, const char* in);
+
+private:
+    void Seek(PageId page);
+    std::FILE* file_;
+    std::size_t page_size_;
+    std::size_t page_num_;
+    std::vector<PageId> free_pages_;
+};
+
+// pages of a PageFile cached in frame_num frames of memory; a page stays in its
+// frame while pinned, and the frames of unpinned pages are reused in clock order
+// (a page used since the hand last passed gets a second chance), writing dirty
+// pages back first. Not thread-safe.
+class BufferPool
+{
+public:
+    BufferPool(PageFile& file, std::size_t frame_num);
+    ~BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    std::size_t page_size() const { return file_.page_size(); }
+    // a new zero-filled page
+    PageId Allocate();
+    // page must not be pinned; its content is dropped
+    void Free(PageId page);
+    // bytes of page, valid until the matching Unpin; throws if every frame is pinned
+    char* Pin(PageId page);
+    void Unpin(PageId page, bool is_dirty);
+    // write every dirty page back
+    void Flush();
+    // a pin finding its page in a frame is a hit, one reading the file a miss
+    std::uint64_t hit_num() const { return hit_num_; }
+    std::uint64_t miss_num() const { return miss_num_; }
+    std::uint64_t eviction_num() const { return eviction_num_; }
+    // hits over pins; 0 before the first pin
+    double HitRate() const;
+    void ResetCounters();
+
+private:
+    struct Frame
+    {
+        PageId page;
+        int pin_count;
+        bool is_used;// holds a page
+        bool is_referenced;// pinned since the clock hand last passed
+        bool is_dirty;
+    };
+    std::size_t Victim();
+    char* FrameData(std::size_t frame) { return memory_.data() + frame * file_.page_size(); }
+
+    PageFile& file_;
+    std::vector<char> memory_;// frame i at i * page_size()
+    std::vector<Frame> frames_;
+    std::unordered_map<PageId, std::size_t> frame_of_;
+    std::size_t clock_hand_;
+    std::uint64_t hit_num_;
+    std::uint64_t miss_num_;
+    std::uint64_t eviction_num_;
+};
+
+// ---------- definition ----------
+
+inline PageFile::PageFile(const std::string& path, std::size_t page_size)
+    : page_size_(page_size), page_num_(0)
+{
+    if (page_size == 0) throw std::invalid_argument("the page size must be positive");
+    file_ = std::fopen(path.c_str(), "w+b");
+    if (file_ == nullptr) throw std::runtime_error("cannot open the page file " + path);
+}
+
+inline PageFile::~PageFile()
+{
+    std::fclose(file_);
+}
+
+inline PageId PageFile::Allocate()
+{
+    PageId page;
+    if (free_pages_.empty()) return page_num_++;
+    page = free_pages_.back();
+    free_pages_.pop_back();
+    return page;
+}
+
+inline void PageFile::Free(PageId page)
+{
+    free_pages_.push_back(page);
+}
+
+inline void PageFile::Seek(PageId page)
+{
+    if (page >= page_num_) throw std::out_of_range("the page is not in the file");
+    if (std::fseek(file_, static_cast<long>(page * page_size_), SEEK_SET) != 0)
+        throw std::runtime_error("cannot seek in the page file");
+}
+
+inline void PageFile::Read(PageId page, char* out)
+{
+    std::size_t read_size;
+    Seek(page);
+    read_size = std::fread(out, 1, page_size_, file_);
+    // past the end of what was written
+    std::memset(out + read_size, 0, page_size_ - read_size);
+}
+
+inline void PageFile::Write(PageId page, const char* in)
+{
+    Seek(page);
+    if (std::fwrite(in, 1, page_size_, file_) != page_size_) throw std::runtime_error("cannot write the page file");
+}
+
+inline BufferPool::BufferPool(PageFile& file, std::size_t frame_num)
+    : file_(file), memory_(frame_num * file.page_size()), frames_(frame_num, Frame{0, 0, false, false, false}),
+    clock_hand_(0), hit_num_(0), miss_num_(0), eviction_num_(0)
+{
+    if (frame_num == 0) throw std::invalid_argument("a buffer pool needs at least one frame");
+}
+
+inline BufferPool::~BufferPool()
+{
+    Flush();
+}
+
+inline PageId BufferPool::Allocate()
+{
+    PageId page;
+    std::size_t frame;
+    // the frame first: if every frame is pinned, no page is taken from the file
+    frame = Victim();
+    page = file_.Allocate();
+    // the page is born in a frame, so it is not read from the file
+    std::memset(FrameData(frame), 0, file_.page_size());
+    frames_[frame] = Frame{page, 0, true, true, true};
+    frame_of_.emplace(page, frame);
+    return page;
+}
+
+inline void BufferPool::Free(PageId page)
+{
+    std::unordered_map<PageId, std::size_t>::iterator it;
+    it = frame_of_.find(page);
+    if (it != frame_of_.end())
+    {
+        if (frames_[it->second].pin_count > 0) throw std::logic_error("cannot free a pinned page");
+        frames_[it->second].is_used = false;
+        frame_of_.erase(it);
+    }
+    file_.Free(page);
+}
+
+inline char* BufferPool::Pin(PageId page)
+{
+    std::unordered_map<PageId, std::size_t>::iterator it;
+    std::size_t frame;
+    it = frame_of_.find(page);
+    if (it != frame_of_.end())
+    {
+        ++hit_num_;
+        frame = it->second;
+    }
+    else
+    {
+        ++miss_num_;
+        frame = Victim();
+        file_.Read(page, FrameData(frame));
+        frames_[frame] = Frame{page, 0, true, false, false};
+        frame_of_.emplace(page, frame);
+    }
+    ++frames_[frame].pin_count;
+    frames_[frame].is_referenced = true;
+    return FrameData(frame);
+}
+
+inline void BufferPool::Unpin(PageId page, bool is_dirty)
+{
+    Frame& frame = frames_[frame_of_.at(page)];
+    --frame.pin_count;
+    frame.is_dirty = frame.is_dirty || is_dirty;
+}
+
+inline void BufferPool::Flush()
+{
+    std::size_t i;
+    for (i = 0; i < frames_.size(); ++i)
+    {
+        if (frames_[i].is_used && frames_[i].is_dirty)
+        {
+            file_.Write(frames_[i].page, FrameData(i));
+            frames_[i].is_dirty = false;
+        }
+    }
+}
+
+inline double BufferPool::HitRate() const
+{
+    if (hit_num_ + miss_num_ == 0) return 0;
+    return static_cast<double>(hit_num_) / (hit_num_ + miss_num_);
+}
+
+inline void BufferPool::ResetCounters()
+{
+    hit_num_ = miss_num_ = eviction_num_ = 0;
+}
+
+// an empty frame, or the first unpinned one the clock hand meets without a second
+// chance, with its page written back if dirty
+inline std::size_t BufferPool::Victim()
+{
+    std::size_t frame, step;
+    // two turns: the first may only clear reference bits
+    for (step = 0; step < 2 * frames_.size(); ++step)
+    {
+        frame = clock_hand_;
+        clock_hand_ = (clock_hand_ + 1) % frames_.size();
+        if (frames_[frame].is_used == false) return frame;
+        if (frames_[frame].pin_count > 0) continue;
+        if (frames_[frame].is_referenced)
+        {
+            frames_[frame].is_referenced = false;
+            continue;
+        }
+        if (frames_[frame].is_dirty) file_.Write(frames_[frame].page, FrameData(frame));
+        frame_of_.erase(frames_[frame].page);
+        frames_[frame].is_used = false;
+        ++eviction_num_;
+        return frame;
+    }
+    throw std::runtime_error("every frame of the buffer pool is pinned");
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _PATH_STACK_HPP
+#define _PATH_STACK_HPP
+
+#include <cstddef>
+#include <cassert>
+
+// stack of at most kCapacity elements stored inline, for paths in a tree
+// whose height has a known bound; it never allocates, and offers the part
+// of the std::stack interface the trees use
+template <class E, std::size_t kCapacity>
+class PathStack
+{
+public:
+    PathStack() : size_(0) {}
+    void push(const E& element)
+    {
+        assert(size_ < kCapacity);
+        elements_[size_++] = element;
+    }
+    void pop() { --size_; }
+    E& top() { return elements_[size_ - 1]; }
+    const E& top() const { return elements_[size_ - 1]; }
+    bool empty() const { return size_ == 0; }
+    std::size_t size() const { return size_; }
+
+private:
+    E elements_[kCapacity];
+    std::size_t size_;
+};
+
+#endif
@@ -0,0 +1,708 @@
+#ifndef _PERSISTENT_B_PLUS_TREE_HPP
+#define _PERSISTENT_B_PLUS_TREE_HPP
+
+#include <utility>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include <stack>
+#include <vector>
+#include <cstddef>
+
+// ---------- declaration ----------
+
+// same interface as PersistentRedBlackTree, but every node holds as many
+// entries as fit in kNodeBytes (a few cache lines), so a lookup touches
+// O(log_B n) nodes instead of O(lg n); updates copy whole nodes along the path
+template <class Key, class T, std::size_t kNodeBytes = 256>
+class PersistentBPlusTree
+{
+public:
+    typedef std::pair<const Key, T> ValueType;
+
+#ifdef PBPT_TESTING
+protected:
+#else
+private:
+#endif
+    struct Node
+    {
+        bool is_leaf;
+        int size;// number of values (leaf) or children (inner node)
+        int use_count;
+        Node(bool is_leaf) : is_leaf(is_leaf), size(0), use_count(0) {}
+    };
+    static constexpr int kLeafSize = (kNodeBytes - sizeof(Node)) / sizeof(ValueType) > 4 ?
+        (kNodeBytes - sizeof(Node)) / sizeof(ValueType) : 4;
+    static constexpr int kInnerSize = (kNodeBytes - sizeof(Node)) / (sizeof(Key) + sizeof(Node*)) > 4 ?
+        (kNodeBytes - sizeof(Node)) / (sizeof(Key) + sizeof(Node*)) : 4;
+    struct LeafNode : Node
+    {
+        ValueType values[kLeafSize];
+        LeafNode() : Node(true) {}
+    };
+    struct InnerNode : Node
+    {
+        Key keys[kInnerSize - 1];// keys[i] separates children[i] and children[i + 1]
+        Node* children[kInnerSize];
+        InnerNode() : Node(false) {}
+    };
+public:
+    class Version
+    {
+    public:
+        Version() : next_(nullptr), prev_(nullptr), root_(nullptr) {}
+    #ifdef PBPT_TESTING
+    public:
+    #else
+    private:
+    #endif
+        friend class PersistentBPlusTree<Key, T, kNodeBytes>;
+        Version(Version* next, Version* prev, Node* root) : next_(next), prev_(prev), root_(root) {}
+        Version* next_;// linked list
+        Version* prev_;// linked list
+        Node* root_;// nullptr if the version is empty
+    };
+    class ConstIterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef ValueType value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef ValueType* pointer;
+        typedef ValueType& reference;
+        ConstIterator& operator++() { tree_->LeafSuccessor(version_, leaf_, index_); return *this; }
+        ConstIterator& operator--() { tree_->LeafPredecessor(version_, leaf_, index_); return *this; }
+        const ValueType& operator*() const { return leaf_->values[index_]; }
+        const ValueType* operator->() const { return &(leaf_->values[index_]); }
+        bool operator==(const ConstIterator& other) const { return leaf_ == other.leaf_ && index_ == other.index_; }
+        bool operator!=(const ConstIterator& other) const { return !(*this == other); }
+        ConstIterator() : leaf_(nullptr), index_(0), tree_(nullptr), version_(nullptr) {}
+        Version* version() { return version_; }
+    private:
+        friend class PersistentBPlusTree<Key, T, kNodeBytes>;
+        ConstIterator(LeafNode* leaf, int index, PersistentBPlusTree<Key, T, kNodeBytes>* tree, Version* version)
+            : leaf_(leaf), index_(index), tree_(tree), version_(version) {}
+        LeafNode* leaf_;// nullptr for CEnd
+        int index_;
+        PersistentBPlusTree<Key, T, kNodeBytes>* tree_;
+        Version* version_;
+    };
+
+    PersistentBPlusTree();
+    ~PersistentBPlusTree();
+    std::pair<ConstIterator, bool> Insert(const ValueType& value, Version* dependent_version);
+    std::pair<ConstIterator, bool> InsertOrAssign(const ValueType& value, Version* dependent_version);
+    std::pair<Version*, bool> Delete(const Key& key, Version* dependent_version);
+    std::pair<ConstIterator, bool> Insert(const ValueType& value);
+    std::pair<ConstIterator, bool> InsertOrAssign(const ValueType& value);
+    std::pair<Version*, bool> Delete(const Key& key);
+    void RemoveVersion(Version* version);
+    void Clear();
+    const T& At(const Key& key, Version* version);
+    ConstIterator Find(const Key& key, Version* version);
+    ConstIterator CBegin(Version* version);
+    ConstIterator CEnd();
+
+#ifdef PBPT_TESTING
+protected:
+#else
+private:
+#endif
+    static void AssignValue(ValueType& destination, const ValueType& source);
+    static int ChildIndex(const InnerNode* node, const Key& key);
+    static int ValueIndex(const LeafNode* node, const Key& key);
+    Version* CreateVersion(Version* dependent_version);
+    void CreateCopyAndPlant(Node** node_ptr);
+    LeafNode* FindLeaf(Node* root, const Key& key, std::vector<int>& route);
+    ConstIterator InsertValue(Version* version, const ValueType& value, bool assign, bool& inserted);
+    bool DeleteValue(Node** root_ptr, const Key& key);
+    void ReleaseSubtree(Node* subtree_root);
+    void LeafSuccessor(Version* version, LeafNode*& leaf, int& index);
+    void LeafPredecessor(Version* version, LeafNode*& leaf, int& index);
+    Version* version_nil_;
+};
+
+// ---------- definition ----------
+
+template <class Key, class T, std::size_t kNodeBytes>
+constexpr int PersistentBPlusTree<Key, T, kNodeBytes>::kLeafSize;
+
+template <class Key, class T, std::size_t kNodeBytes>
+constexpr int PersistentBPlusTree<Key, T, kNodeBytes>::kInnerSize;
+
+template <class Key, class T, std::size_t kNodeBytes>
+PersistentBPlusTree<Key, T, kNodeBytes>::PersistentBPlusTree()
+{
+    version_nil_ = new Version();
+    version_nil_->next_ = version_nil_->prev_ = version_nil_;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+PersistentBPlusTree<Key, T, kNodeBytes>::~PersistentBPlusTree()
+{
+    Clear();
+    delete version_nil_;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+void PersistentBPlusTree<Key, T, kNodeBytes>::AssignValue(ValueType& destination, const ValueType& source)
+{
+    const_cast<Key&>(destination.first) = source.first;
+    destination.second = source.second;
+}
+
+// index of the child whose subtree may contain key
+template <class Key, class T, std::size_t kNodeBytes>
+int PersistentBPlusTree<Key, T, kNodeBytes>::ChildIndex(const InnerNode* node, const Key& key)
+{
+    return std::upper_bound(node->keys, node->keys + node->size - 1, key) - node->keys;
+}
+
+// index of the first value whose key is not less than key
+template <class Key, class T, std::size_t kNodeBytes>
+int PersistentBPlusTree<Key, T, kNodeBytes>::ValueIndex(const LeafNode* node, const Key& key)
+{
+    return std::lower_bound(node->values, node->values + node->size, key,
+        [](const ValueType& value, const Key& key) { return value.first < key; }) - node->values;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+typename PersistentBPlusTree<Key, T, kNodeBytes>::Version* PersistentBPlusTree<Key, T, kNodeBytes>::CreateVersion
+    (Version* dependent_version)
+{
+    Version* new_version;
+    new_version = new Version(version_nil_->next_, version_nil_, dependent_version->root_);
+    if (new_version->root_ != nullptr) ++new_version->root_->use_count;// shared until the first path copy
+    version_nil_->next_ = new_version;
+    new_version->next_->prev_ = new_version;
+    return new_version;
+}
+
+// make *node_ptr owned only by the tree being built; a node which is
+// still used by other versions (use_count > 0) is replaced by a copy
+template <class Key, class T, std::size_t kNodeBytes>
+void PersistentBPlusTree<Key, T, kNodeBytes>::CreateCopyAndPlant(Node** node_ptr)
+{
+    LeafNode *leaf, *leaf_copy;
+    InnerNode *inner, *inner_copy;
+    int i;
+    if ((*node_ptr)->use_count == 0) return;
+    --(*node_ptr)->use_count;
+    if ((*node_ptr)->is_leaf)
+    {
+        leaf = static_cast<LeafNode*>(*node_ptr);
+        leaf_copy = new LeafNode();
+        for (i = 0; i < leaf->size; ++i)
+            AssignValue(leaf_copy->values[i], leaf->values[i]);
+        leaf_copy->size = leaf->size;
+        *node_ptr = leaf_copy;
+    }
+    else
+    {
+        inner = static_cast<InnerNode*>(*node_ptr);
+        inner_copy = new InnerNode();
+        for (i = 0; i < inner->size; ++i)
+        {
+            if (i > 0) inner_copy->keys[i - 1] = inner->keys[i - 1];
+            inner_copy->children[i] = inner->children[i];
+            ++inner->children[i]->use_count;
+        }
+        inner_copy->size = inner->size;
+        *node_ptr = inner_copy;
+    }
+}
+
+// the leaf of the subtree of root whose range holds key; route gets the child index
+// taken at each inner node, so an update can copy the path without searching again
+template <class Key, class T, std::size_t kNodeBytes>
+typename PersistentBPlusTree<Key, T, kNodeBytes>::LeafNode* PersistentBPlusTree<Key, T, kNodeBytes>::FindLeaf
+    (Node* root, const Key& key, std::vector<int>& route)
+{
+    InnerNode* inner;
+    route.clear();
+    while (root->is_leaf == false)
+    {
+        inner = static_cast<InnerNode*>(root);
+        route.push_back(ChildIndex(inner, key));
+        root = inner->children[route.back()];
+    }
+    return static_cast<LeafNode*>(root);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator PersistentBPlusTree<Key, T, kNodeBytes>::Find
+    (const Key& key, Version* version)
+{
+    Node* now;
+    LeafNode* leaf;
+    int index;
+    now = version->root_;
+    if (now == nullptr) return CEnd();
+    while (now->is_leaf == false)
+        now = static_cast<InnerNode*>(now)->children[ChildIndex(static_cast<InnerNode*>(now), key)];
+    leaf = static_cast<LeafNode*>(now);
+    index = ValueIndex(leaf, key);
+    if (index < leaf->size && leaf->values[index].first == key)
+        return ConstIterator(leaf, index, this, version);
+    return CEnd();
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+const T& PersistentBPlusTree<Key, T, kNodeBytes>::At(const Key& key, Version* version)
+{
+    ConstIterator it;
+    it = Find(key, version);
+    if (it == CEnd()) throw std::out_of_range("the container does not have an element with the specified key");
+    return it->second;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+std::pair<typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator, bool>
+    PersistentBPlusTree<Key, T, kNodeBytes>::Insert
+    (const ValueType& value)
+{
+    return Insert(value, version_nil_->next_);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+std::pair<typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator, bool>
+    PersistentBPlusTree<Key, T, kNodeBytes>::Insert
+    (const ValueType& value, Version* dependent_version)
+{
+    ConstIterator it;
+    bool inserted;
+    it = InsertValue(CreateVersion(dependent_version), value, false, inserted);
+    return std::make_pair(it, inserted);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+std::pair<typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator, bool>
+    PersistentBPlusTree<Key, T, kNodeBytes>::InsertOrAssign
+    (const ValueType& value)
+{
+    return InsertOrAssign(value, version_nil_->next_);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+std::pair<typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator, bool>
+    PersistentBPlusTree<Key, T, kNodeBytes>::InsertOrAssign
+    (const ValueType& value, Version* dependent_version)
+{
+    ConstIterator it;
+    bool inserted;
+    it = InsertValue(CreateVersion(dependent_version), value, true, inserted);
+    return std::make_pair(it, inserted);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator PersistentBPlusTree<Key, T, kNodeBytes>::InsertValue
+    (Version* version, const ValueType& value, bool assign, bool& inserted)
+{
+    ValueType values[kLeafSize + 1];
+    Key keys[kInnerSize];
+    Node *children[kInnerSize + 1], **now_ptr, *new_child;
+    std::stack<InnerNode*> path;
+    std::vector<int> route;
+    InnerNode *inner, *new_inner;
+    LeafNode *leaf, *new_leaf;
+    int index, child_index, i, left_size;
+    std::size_t depth;
+    Key separator;
+    now_ptr = &(version->root_);
+    if (*now_ptr == nullptr)
+    {
+        leaf = new LeafNode();
+        AssignValue(leaf->values[0], value);
+        leaf->size = 1;
+        *now_ptr = leaf;
+        inserted = true;
+        return ConstIterator(leaf, 0, this, version);
+    }
+    leaf = FindLeaf(*now_ptr, value.first, route);
+    index = ValueIndex(leaf, value.first);
+    inserted = index == leaf->size || !(leaf->values[index].first == value.first);
+    // nothing changes; the version keeps sharing the whole tree
+    if (inserted == false && assign == false) return ConstIterator(leaf, index, this, version);
+    // copy the nodes along the route found, without comparing keys again
+    for (depth = 0; depth < route.size(); ++depth)
+    {
+        CreateCopyAndPlant(now_ptr);
+        inner = static_cast<InnerNode*>(*now_ptr);
+        path.push(inner);
+        now_ptr = &(inner->children[route[depth]]);
+    }
+    CreateCopyAndPlant(now_ptr);
+    leaf = static_cast<LeafNode*>(*now_ptr);
+    if (inserted == false)
+    {
+        leaf->values[index].second = value.second;
+        return ConstIterator(leaf, index, this, version);
+    }
+    if (leaf->size < kLeafSize)
+    {
+        for (i = leaf->size; i > index; --i)
+            AssignValue(leaf->values[i], leaf->values[i - 1]);
+        AssignValue(leaf->values[index], value);
+        ++leaf->size;
+        return ConstIterator(leaf, index, this, version);
+    }
+    // split the full leaf
+    for (i = 0; i < kLeafSize; ++i)
+        AssignValue(values[i < index ? i : i + 1], leaf->values[i]);
+    AssignValue(values[index], value);
+    left_size = (kLeafSize + 1) / 2;
+    new_leaf = new LeafNode();
+    for (i = 0; i < kLeafSize + 1; ++i)
+        AssignValue(i < left_size ? leaf->values[i] : new_leaf->values[i - left_size], values[i]);
+    leaf->size = left_size;
+    new_leaf->size = kLeafSize + 1 - left_size;
+    ConstIterator result(index < left_size ? leaf : new_leaf,
+        index < left_size ? index : index - left_size, this, version);
+    separator = new_leaf->values[0].first;
+    new_child = new_leaf;
+    // insert the new sibling into the parents, splitting them as needed
+    while (path.empty() == false)
+    {
+        inner = path.top();
+        path.pop();
+        child_index = ChildIndex(inner, value.first);
+        if (inner->size < kInnerSize)
+        {
+            for (i = inner->size; i > child_index + 1; --i)
+            {
+                inner->keys[i - 1] = inner->keys[i - 2];
+                inner->children[i] = inner->children[i - 1];
+            }
+            inner->keys[child_index] = separator;
+            inner->children[child_index + 1] = new_child;
+            ++inner->size;
+            return result;
+        }
+        for (i = 0; i < kInnerSize; ++i)
+        {
+            if (i < kInnerSize - 1) keys[i < child_index ? i : i + 1] = inner->keys[i];
+            children[i <= child_index ? i : i + 1] = inner->children[i];
+        }
+        keys[child_index] = separator;
+        children[child_index + 1] = new_child;
+        left_size = (kInnerSize + 1) / 2;
+        new_inner = new InnerNode();
+        for (i = 0; i < kInnerSize + 1; ++i)
+        {
+            if (i < left_size)
+            {
+                inner->children[i] = children[i];
+                if (i < left_size - 1) inner->keys[i] = keys[i];
+            }
+            else
+            {
+                new_inner->children[i - left_size] = children[i];
+                if (i < kInnerSize) new_inner->keys[i - left_size] = keys[i];
+            }
+        }
+        inner->size = left_size;
+        new_inner->size = kInnerSize + 1 - left_size;
+        separator = keys[left_size - 1];
+        new_child = new_inner;
+    }
+    // the root was split
+    new_inner = new InnerNode();
+    new_inner->children[0] = version->root_;
+    new_inner->children[1] = new_child;
+    new_inner->keys[0] = separator;
+    new_inner->size = 2;
+    version->root_ = new_inner;
+    return result;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+std::pair<typename PersistentBPlusTree<Key, T, kNodeBytes>::Version*, bool>
+PersistentBPlusTree<Key, T, kNodeBytes>::Delete(const Key& key)
+{
+    return Delete(key, version_nil_->next_);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+std::pair<typename PersistentBPlusTree<Key, T, kNodeBytes>::Version*, bool>
+PersistentBPlusTree<Key, T, kNodeBytes>::Delete(const Key& key, Version* dependent_version)
+{
+    Version* new_version;
+    bool found;
+    new_version = CreateVersion(dependent_version);
+    found = DeleteValue(&(new_version->root_), key);
+    return std::make_pair(new_version, found);
+}
+
+// false if key is not in the tree, which is then left as it is
+template <class Key, class T, std::size_t kNodeBytes>
+bool PersistentBPlusTree<Key, T, kNodeBytes>::DeleteValue(Node** root_ptr, const Key& key)
+{
+    std::stack<std::pair<InnerNode*, int> > path;
+    std::vector<int> route;
+    Node **now_ptr, *node, *left, *right;
+    InnerNode *parent, *inner, *left_inner, *right_inner;
+    LeafNode *leaf, *left_leaf, *right_leaf;
+    int index, left_index, min_size, i;
+    std::size_t depth;
+    now_ptr = root_ptr;
+    if (*now_ptr == nullptr) return false;
+    leaf = FindLeaf(*now_ptr, key, route);
+    index = ValueIndex(leaf, key);
+    if (index == leaf->size || !(leaf->values[index].first == key)) return false;
+    // copy the nodes along the route found, without comparing keys again
+    for (depth = 0; depth < route.size(); ++depth)
+    {
+        CreateCopyAndPlant(now_ptr);
+        inner = static_cast<InnerNode*>(*now_ptr);
+        path.push(std::make_pair(inner, route[depth]));
+        now_ptr = &(inner->children[route[depth]]);
+    }
+    CreateCopyAndPlant(now_ptr);
+    leaf = static_cast<LeafNode*>(*now_ptr);
+    for (i = index; i < leaf->size - 1; ++i)
+        AssignValue(leaf->values[i], leaf->values[i + 1]);
+    --leaf->size;
+    node = leaf;
+    // fix underflow bottom-up by borrowing from or merging with a sibling
+    while (path.empty() == false)
+    {
+        parent = path.top().first;
+        index = path.top().second;
+        path.pop();
+        min_size = node->is_leaf ? kLeafSize / 2 : (kInnerSize + 1) / 2;
+        if (node->size >= min_size) return true;
+        left_index = index > 0 ? index - 1 : index;
+        CreateCopyAndPlant(&(parent->children[left_index]));
+        left = parent->children[left_index];
+        right = parent->children[left_index + 1];
+        if (left->size + right->size <= (node->is_leaf ? kLeafSize : kInnerSize))
+        {
+            // merge right into left
+            if (node->is_leaf)
+            {
+                left_leaf = static_cast<LeafNode*>(left);
+                right_leaf = static_cast<LeafNode*>(right);
+                for (i = 0; i < right_leaf->size; ++i)
+                    AssignValue(left_leaf->values[left_leaf->size + i], right_leaf->values[i]);
+            }
+            else
+            {
+                left_inner = static_cast<InnerNode*>(left);
+                right_inner = static_cast<InnerNode*>(right);
+                left_inner->keys[left_inner->size - 1] = parent->keys[left_index];
+                for (i = 0; i < right_inner->size; ++i)
+                {
+                    if (i > 0) left_inner->keys[left_inner->size + i - 1] = right_inner->keys[i - 1];
+                    left_inner->children[left_inner->size + i] = right_inner->children[i];
+                    // children of a right node still used by other versions gain a parent
+                    if (right->use_count > 0) ++right_inner->children[i]->use_count;
+                }
+            }
+            left->size += right->size;
+            if (right->use_count > 0)
+                --right->use_count;
+            else if (right->is_leaf)
+                delete static_cast<LeafNode*>(right);
+            else
+                delete static_cast<InnerNode*>(right);
+            for (i = left_index + 1; i < parent->size - 1; ++i)
+            {
+                parent->keys[i - 1] = parent->keys[i];
+                parent->children[i] = parent->children[i + 1];
+            }
+            --parent->size;
+            node = parent;
+            continue;
+        }
+        CreateCopyAndPlant(&(parent->children[left_index + 1]));
+        right = parent->children[left_index + 1];
+        if (node == right)
+        {
+            // borrow the last entry of left
+            if (node->is_leaf)
+            {
+                left_leaf = static_cast<LeafNode*>(left);
+                right_leaf = static_cast<LeafNode*>(right);
+                for (i = right_leaf->size; i > 0; --i)
+                    AssignValue(right_leaf->values[i], right_leaf->values[i - 1]);
+                AssignValue(right_leaf->values[0], left_leaf->values[left_leaf->size - 1]);
+                parent->keys[left_index] = right_leaf->values[0].first;
+            }
+            else
+            {
+                left_inner = static_cast<InnerNode*>(left);
+                right_inner = static_cast<InnerNode*>(right);
+                for (i = right_inner->size; i > 0; --i)
+                {
+                    if (i > 1) right_inner->keys[i - 1] = right_inner->keys[i - 2];
+                    right_inner->children[i] = right_inner->children[i - 1];
+                }
+                right_inner->keys[0] = parent->keys[left_index];
+                right_inner->children[0] = left_inner->children[left_inner->size - 1];
+                parent->keys[left_index] = left_inner->keys[left_inner->size - 2];
+            }
+        }
+        else
+        {
+            // borrow the first entry of right
+            if (node->is_leaf)
+            {
+                left_leaf = static_cast<LeafNode*>(left);
+                right_leaf = static_cast<LeafNode*>(right);
+                AssignValue(left_leaf->values[left_leaf->size], right_leaf->values[0]);
+                for (i = 0; i < right_leaf->size - 1; ++i)
+                    AssignValue(right_leaf->values[i], right_leaf->values[i + 1]);
+                parent->keys[left_index] = right_leaf->values[0].first;
+            }
+            else
+            {
+                left_inner = static_cast<InnerNode*>(left);
+                right_inner = static_cast<InnerNode*>(right);
+                left_inner->keys[left_inner->size - 1] = parent->keys[left_index];
+                left_inner->children[left_inner->size] = right_inner->children[0];
+                parent->keys[left_index] = right_inner->keys[0];
+                for (i = 0; i < right_inner->size - 1; ++i)
+                {
+                    if (i < right_inner->size - 2) right_inner->keys[i] = right_inner->keys[i + 1];
+                    right_inner->children[i] = right_inner->children[i + 1];
+                }
+            }
+        }
+        ++node->size;
+        --(node == left ? right : left)->size;
+        return true;
+    }
+    // now, node is the root
+    if (node->is_leaf && node->size == 0)
+    {
+        delete static_cast<LeafNode*>(node);
+        *root_ptr = nullptr;
+    }
+    else if (node->is_leaf == false && node->size == 1)
+    {
+        *root_ptr = static_cast<InnerNode*>(node)->children[0];
+        delete static_cast<InnerNode*>(node);
+    }
+    return true;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+void PersistentBPlusTree<Key, T, kNodeBytes>::ReleaseSubtree(Node* subtree_root)
+{
+    int i;
+    if (subtree_root == nullptr) return;
+    if (subtree_root->use_count > 0)
+    {
+        --subtree_root->use_count;
+        return;
+    }
+    if (subtree_root->is_leaf)
+    {
+        delete static_cast<LeafNode*>(subtree_root);
+        return;
+    }
+    for (i = 0; i < subtree_root->size; ++i)
+        ReleaseSubtree(static_cast<InnerNode*>(subtree_root)->children[i]);
+    delete static_cast<InnerNode*>(subtree_root);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+void PersistentBPlusTree<Key, T, kNodeBytes>::LeafSuccessor(Version* version, LeafNode*& leaf, int& index)
+{
+    Node *now, *next;
+    InnerNode* inner;
+    int child_index;
+    if (index + 1 < leaf->size)
+    {
+        ++index;
+        return;
+    }
+    // the first value of the next leaf; search it from the root
+    now = version->root_;
+    next = nullptr;
+    while (now->is_leaf == false)
+    {
+        inner = static_cast<InnerNode*>(now);
+        child_index = ChildIndex(inner, leaf->values[index].first);
+        if (child_index + 1 < inner->size) next = inner->children[child_index + 1];
+        now = inner->children[child_index];
+    }
+    index = 0;
+    if (next == nullptr)
+    {
+        leaf = nullptr;
+        return;
+    }
+    while (next->is_leaf == false)
+        next = static_cast<InnerNode*>(next)->children[0];
+    leaf = static_cast<LeafNode*>(next);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+void PersistentBPlusTree<Key, T, kNodeBytes>::LeafPredecessor(Version* version, LeafNode*& leaf, int& index)
+{
+    Node *now, *prev;
+    InnerNode* inner;
+    int child_index;
+    if (index > 0)
+    {
+        --index;
+        return;
+    }
+    // the last value of the previous leaf; search it from the root
+    now = version->root_;
+    prev = nullptr;
+    while (now->is_leaf == false)
+    {
+        inner = static_cast<InnerNode*>(now);
+        child_index = ChildIndex(inner, leaf->values[0].first);
+        if (child_index > 0) prev = inner->children[child_index - 1];
+        now = inner->children[child_index];
+    }
+    if (prev == nullptr)
+    {
+        leaf = nullptr;
+        index = 0;
+        return;
+    }
+    while (prev->is_leaf == false)
+        prev = static_cast<InnerNode*>(prev)->children[prev->size - 1];
+    leaf = static_cast<LeafNode*>(prev);
+    index = leaf->size - 1;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+void PersistentBPlusTree<Key, T, kNodeBytes>::RemoveVersion(Version* version)
+{
+    ReleaseSubtree(version->root_);
+    version->prev_->next_ = version->next_;
+    version->next_->prev_ = version->prev_;
+    delete version;
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+void PersistentBPlusTree<Key, T, kNodeBytes>::Clear()
+{
+    while (version_nil_->next_ != version_nil_) RemoveVersion(version_nil_->next_);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator PersistentBPlusTree<Key, T, kNodeBytes>::CBegin
+    (Version* version)
+{
+    Node* now;
+    now = version->root_;
+    if (now == nullptr) return CEnd();
+    while (now->is_leaf == false)
+        now = static_cast<InnerNode*>(now)->children[0];
+    return ConstIterator(static_cast<LeafNode*>(now), 0, this, version);
+}
+
+template <class Key, class T, std::size_t kNodeBytes>
+typename PersistentBPlusTree<Key, T, kNodeBytes>::ConstIterator PersistentBPlusTree<Key, T, kNodeBytes>::CEnd()
+{
+    return ConstIterator(nullptr, 0, this, version_nil_);
+}
+
+#endif
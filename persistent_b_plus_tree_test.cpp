@@ -0,0 +1,113 @@
+#include "persistent_b_plus_tree_test.hpp"
+
+#ifndef CATCH_CONFIG_MAIN
+#  define CATCH_CONFIG_MAIN
+#endif
+#include <catch/catch.hpp>
+
+#include <map>
+#include <random>
+
+typedef PersistentBPlusTreeTest<int, char> Tree;
+// few entries per node, so that splits and merges happen on every level
+typedef PersistentBPlusTreeTest<int, char, 64> SmallTree;
+typedef typename std::pair<int, char> NonConstValueType;
+
+TEST_CASE("Simple Case", "")
+{
+    Tree tree;
+    std::vector<NonConstValueType> require_values;
+    std::pair<Tree::ConstIterator, bool> insert_result;
+    std::pair<Tree::Version*, bool> delete_result;
+    Tree::Version *version, *empty_version;
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        insert_result = tree.Insert({i * 7 % 1000, 'a'});
+        REQUIRE(insert_result.second);
+        REQUIRE(insert_result.first->first == i * 7 % 1000);
+    }
+    version = insert_result.first.version();
+    for (int i = 0; i < 1000; ++i) require_values.push_back({i, 'a'});
+    REQUIRE(tree.CheckTreeValid(version, require_values));
+
+    insert_result = tree.Insert({10, 'b'});
+    REQUIRE_FALSE(insert_result.second);
+    REQUIRE(insert_result.first->second == 'a');
+    // an update that changes nothing copies no node
+    REQUIRE(insert_result.first.version()->root_ == version->root_);
+    REQUIRE(tree.Delete(-1, version).first->root_ == version->root_);
+    insert_result = tree.InsertOrAssign({10, 'b'});
+    REQUIRE_FALSE(insert_result.second);
+    REQUIRE(tree.At(10, insert_result.first.version()) == 'b');
+    REQUIRE(tree.At(10, version) == 'a');
+    REQUIRE_THROWS_AS(tree.At(1000, version), std::out_of_range);
+
+    delete_result = tree.Delete(10);
+    REQUIRE(delete_result.second);
+    REQUIRE(tree.Find(10, delete_result.first) == tree.CEnd());
+    REQUIRE(tree.Find(11, delete_result.first)->first == 11);
+    REQUIRE_FALSE(tree.Delete(10).second);
+
+    empty_version = version;
+    for (int i = 0; i < 1000; ++i) empty_version = tree.Delete(i, empty_version).first;
+    REQUIRE(tree.CBegin(empty_version) == tree.CEnd());
+    REQUIRE(tree.CheckTreeValid(version, require_values));
+}
+
+TEST_CASE("random operations on random versions", "")
+{
+    SmallTree tree;
+    std::vector<std::pair<SmallTree::Version*, std::map<int, char>>> versions;
+    std::vector<NonConstValueType> require_values;
+    std::map<int, char> expected;
+    std::mt19937 rng(2022);
+    SmallTree::Version* dependent_version;
+    size_t index;
+    int key;
+
+    for (int i = 0; i < 1500; ++i)
+    {
+        key = rng() % 256;
+        if (versions.empty())
+        {
+            dependent_version = tree.EmptyVersion();
+            expected.clear();
+        }
+        else
+        {
+            index = rng() % versions.size();
+            dependent_version = versions[index].first;
+            expected = versions[index].second;
+        }
+        switch (rng() % 4)
+        {
+        case 0:
+            expected.insert({key, 'a' + i % 26});
+            versions.push_back({tree.Insert({key, 'a' + i % 26}, dependent_version).first.version(), expected});
+            break;
+        case 1:
+            expected[key] = 'a' + i % 26;
+            versions.push_back({tree.InsertOrAssign({key, 'a' + i % 26}, dependent_version).first.version(), expected});
+            break;
+        default:
+            expected.erase(key);
+            versions.push_back({tree.Delete(key, dependent_version).first, expected});
+            break;
+        }
+        if (versions.size() > 32)
+        {
+            index = rng() % versions.size();
+            tree.RemoveVersion(versions[index].first);
+            versions.erase(versions.begin() + index);
+        }
+        if (i % 10 == 0)
+        {
+            for (auto& version : versions)
+            {
+                require_values.assign(version.second.begin(), version.second.end());
+                REQUIRE(tree.CheckTreeValid(version.first, require_values));
+            }
+        }
+    }
+}
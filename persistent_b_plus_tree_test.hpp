@@ -0,0 +1,92 @@
+#ifndef _PERSISTENT_B_PLUS_TREE_TEST_HPP
+#define _PERSISTENT_B_PLUS_TREE_TEST_HPP
+
+#define PBPT_TESTING
+
+#include "persistent_b_plus_tree.hpp"
+
+#include <vector>
+
+template <class Key, class T, std::size_t kNodeBytes = 256>
+class PersistentBPlusTreeTest : public PersistentBPlusTree<Key, T, kNodeBytes>
+{
+public:
+    typedef PersistentBPlusTree<Key, T, kNodeBytes> Tree;
+    typedef typename Tree::Node Node;
+    typedef typename Tree::LeafNode LeafNode;
+    typedef typename Tree::InnerNode InnerNode;
+    typedef typename Tree::Version* VersionPtr;
+    typedef typename Tree::ConstIterator CIterator;
+    typedef typename std::pair<Key, T> NonConstValueType;
+    // return depth of the leaves in the subtree whose keys must lie in [lower, upper)
+    // (nullptr means unbounded); return -1 means the tree is invalid
+    int CheckSubtreeValid(const Node* subtree_root, bool is_root, const Key* lower, const Key* upper)
+    {
+        const LeafNode* leaf;
+        const InnerNode* inner;
+        int i, depth, child_depth;
+        if (subtree_root->size > (subtree_root->is_leaf ? Tree::kLeafSize : Tree::kInnerSize)) return -1;
+        if (is_root == false && subtree_root->size < (subtree_root->is_leaf ? Tree::kLeafSize / 2 : (Tree::kInnerSize + 1) / 2))
+            return -1;
+        if (subtree_root->is_leaf)
+        {
+            leaf = static_cast<const LeafNode*>(subtree_root);
+            if (leaf->size == 0) return -1;
+            for (i = 0; i < leaf->size; ++i)
+            {
+                if (i > 0 && !(leaf->values[i - 1].first < leaf->values[i].first)) return -1;
+                if (lower != nullptr && leaf->values[i].first < *lower) return -1;
+                if (upper != nullptr && !(leaf->values[i].first < *upper)) return -1;
+            }
+            return 0;
+        }
+        inner = static_cast<const InnerNode*>(subtree_root);
+        if (inner->size < 2) return -1;
+        depth = -1;
+        for (i = 0; i < inner->size; ++i)
+        {
+            child_depth = CheckSubtreeValid(inner->children[i], false,
+                i == 0 ? lower : &(inner->keys[i - 1]), i == inner->size - 1 ? upper : &(inner->keys[i]));
+            if (child_depth == -1 || (depth != -1 && child_depth != depth)) return -1;
+            depth = child_depth;
+        }
+        return depth + 1;
+    }
+
+    bool CheckTreeValid(VersionPtr version, const std::vector<NonConstValueType>& require_values)
+    {
+        size_t require_values_index;
+        CIterator it;
+        if (version->root_ != nullptr && CheckSubtreeValid(version->root_, true, nullptr, nullptr) == -1) 
+            return false;
+        require_values_index = 0;
+        for (it = this->CBegin(version); it != this->CEnd(); ++it)
+        {
+            if (require_values_index == require_values.size() ||
+                require_values[require_values_index].first != it->first ||
+                require_values[require_values_index].second != it->second)
+                return false;
+            ++require_values_index;
+        }
+        if (require_values_index != require_values.size()) return false;
+        // walk backward from the last value
+        if (require_values.empty() == false)
+        {
+            it = this->Find(require_values.back().first, version);
+            for (size_t i = require_values.size(); i > 0; --i, --it)
+            {
+                if (it == this->CEnd() || require_values[i - 1].first != it->first) return false;
+            }
+            if (it != this->CEnd()) return false;
+        }
+        return true;
+    }
+
+    VersionPtr EmptyVersion()
+    {
+        return this->version_nil_;
+    }
+
+};
+
+#endif
@@ -5,22 +5,51 @@
 #include <iterator>
 #include <stdexcept>
 #include <memory>
-#include <stack>
+#include <new>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <functional>
+#include "frozen_version.hpp"
+#include "aggregate_monoid.hpp"
+#include "value_traits.hpp"
+#include "path_stack.hpp"
+#include "page_store.hpp"
 
 // ---------- declaration ----------
 
-template <class Key, class T>
+// Monoid (see aggregate_monoid.hpp) augments every node with the aggregate of its subtree;
+// T = SetMapped stores keys alone (see value_traits.hpp), and kMulti permits equal keys,
+// which are kept in insertion order
+template <class Key, class T, class Monoid = NoAggregate, bool kMulti = false>
 class PersistentRedBlackTree
 {
 public:
-    typedef std::pair<const Key, T> ValueType;
+    typedef typename ValueTraits<Key, T>::ValueType ValueType;
+    typedef typename Monoid::Type AggregateType;
+    typedef std::size_t VersionId;
+    typedef std::chrono::system_clock Clock;
+    typedef Clock::time_point TimePoint;
+    // id of the empty version every tree starts from; never returned by GetVersion
+    static constexpr VersionId kNilVersionId = 0;
+    // elements per chunk of ExportColumns unless given
+    static constexpr std::size_t kColumnChunkSize = 4096;
 
 #ifdef PRBT_TESTING
 protected:
 #else
 private:
 #endif
-    struct Node
+    struct Node : AggregateStorage<Monoid>, InsertionOrder<kMulti>
     {
         Node* left;
         Node* right;
@@ -30,21 +59,103 @@ private:
         Node() : use_count(0) {}
         Node(const ValueType& value) : use_count(0), value(value) {}
     };
+    // one of the interleaved searches of FindMany; handles keys [index, end)
+    struct Descent
+    {
+        std::size_t index;
+        std::size_t end;
+        Node* now;
+        std::vector<Node*> left_turns;// nodes where the search went left; kept for sorted keys
+    };
+    static constexpr int kDescentGroupSize = 16;
+    static constexpr int kHistoryMemoSize = 256;// power of two, comfortably above a path length
+    static constexpr std::size_t kHistoryLookahead = 4;// versions whose roots are prefetched ahead
+    // a tree of n nodes is at most 2 lg(n + 1) high; a path may also hold the
+    // slot below its last node, and ReleaseSubtree a sentinel
+    static constexpr std::size_t kMaxPathLength = 2 * std::numeric_limits<std::size_t>::digits + 2;
+    static constexpr std::size_t kVersionChunkSize = 64;// Version records allocated at a time
+    typedef PathStack<Node**, kMaxPathLength> SlotPath;
+    typedef PathStack<Node*, kMaxPathLength> NodePath;
+    // a node on the path of the finger, with the nearest ancestors bounding its subtree
+    struct FingerStep
+    {
+        Node* node;
+        Node* lower;// nullptr if unbounded
+        Node* upper;// nullptr if unbounded
+    };
+    struct Difference
+    {
+        Node* base;// nil_ if the key is absent in base
+        Node* branch;// nil_ if the key is absent in branch
+    };
+    // nodes are equal if they hold the same element and color above the same children
+    struct NodeContentHash
+    {
+        std::size_t operator()(const Node* node) const
+        {
+            std::size_t hash;
+            hash = std::hash<Key>()(KeyOf(node));
+            hash = hash * 31 + std::hash<const Node*>()(node->left);
+            hash = hash * 31 + std::hash<const Node*>()(node->right);
+            return hash * 2 + node->color;
+        }
+    };
+    struct NodeContentEqual
+    {
+        bool operator()(const Node* a, const Node* b) const
+        {
+            return a->left == b->left && a->right == b->right && a->color == b->color &&
+                KeyOf(a) == KeyOf(b) && MappedOf(a) == MappedOf(b) &&
+                !a->Precedes(*b) && !b->Precedes(*a);
+        }
+    };
+    typedef std::unordered_set<Node*, NodeContentHash, NodeContentEqual> CanonicalNodeSet;
+    // block of nodes moved by Compact, freed with its last node
+    struct NodeArena
+    {
+        std::size_t size;
+        std::size_t live;
+    };
+    // index of a node record in the page store; records are immutable, like the nodes
+    typedef std::uint64_t StoredNodeId;
+    static constexpr StoredNodeId kNilStoredNodeId = 0;
+    // a node written by PageOut; key and mapped value are copied bytewise
+    struct StoredNode
+    {
+        StoredNodeId left;
+        StoredNodeId right;
+        std::uint64_t sequence;
+        int color;
+        alignas(Key) unsigned char key[sizeof(Key)];
+        alignas(T) unsigned char mapped[sizeof(T)];
+    };
 public:
     class Version
     {
     public:
-        Version() : next_(nullptr), prev_(nullptr), root_(nullptr) {}
+        Version() : next_(nullptr), prev_(nullptr), root_(nullptr), leftmost_(nullptr), rightmost_(nullptr),
+            id_(kNilVersionId), parent_id_(kNilVersionId), reads_(0), stored_root_(kNilStoredNodeId) {}
+        VersionId id() const { return id_; }
+        // false while paged out
+        bool is_resident() const { return root_ != nullptr; }
+        VersionId parent_id() const { return parent_id_; }
+        TimePoint timestamp() const { return timestamp_; }
     #ifdef PRBT_TESTING
     public:
     #else
     private:
     #endif
-        friend class PersistentRedBlackTree<Key, T>;
-        Version(Version* next, Version* prev, Node* root) : next_(next), prev_(prev), root_(root) {}
+        friend class PersistentRedBlackTree<Key, T, Monoid, kMulti>;
         Version* next_;// linked list
         Version* prev_;// linked list
-        Node* root_;
+        Node* root_;// nullptr while paged out
+        Node* leftmost_;// minimum; nil_ if empty, nullptr while paged out
+        Node* rightmost_;// maximum; nil_ if empty, nullptr while paged out
+        VersionId id_;// monotonically increasing, index of versions_
+        VersionId parent_id_;// id of the dependent version
+        TimePoint timestamp_;// creation time, never earlier than the previous version's
+        std::atomic<std::uint32_t> reads_;// lookups since the last compaction, counted for CompactHotVersions
+        StoredNodeId stored_root_;// copy written by PageOut, kept until removal; kNilStoredNodeId if none
     };
     class ConstIterator : public std::iterator<std::bidirectional_iterator_tag, ValueType>
     {
@@ -58,11 +169,11 @@ public:
         ConstIterator() : node_(nullptr), tree_(nullptr), version_(nullptr) {}
         Version* version() { return version_; }
     private:
-        friend class PersistentRedBlackTree<Key, T>;
-        ConstIterator(Node* node, PersistentRedBlackTree<Key, T>* tree, Version* version) 
+        friend class PersistentRedBlackTree<Key, T, Monoid, kMulti>;
+        ConstIterator(Node* node, PersistentRedBlackTree<Key, T, Monoid, kMulti>* tree, Version* version) 
             : node_(node), tree_(tree), version_(version) {}
         Node* node_;
-        PersistentRedBlackTree<Key, T>* tree_;
+        PersistentRedBlackTree<Key, T, Monoid, kMulti>* tree_;
         Version* version_;
     };
 
@@ -74,55 +185,258 @@ public:
     std::pair<ConstIterator, bool> Insert(const ValueType& value);
     std::pair<ConstIterator, bool> InsertOrAssign(const ValueType& value);
     std::pair<Version*, bool> Delete(const Key& key);
+    // delete the minimum (maximum) element; the search is the left (right) spine
+    std::pair<Version*, bool> PopMin(Version* dependent_version);
+    std::pair<Version*, bool> PopMax(Version* dependent_version);
+    std::pair<Version*, bool> PopMin();
+    std::pair<Version*, bool> PopMax();
+    // finger operations: hint is an iterator into the version to use, and the search
+    // climbs from it to the lowest ancestor whose subtree covers the key, then descends.
+    // That is O(lg n) in the worst case (keys adjacent in order may only meet at the
+    // root), and cheaper for a key inside a small subtree around the hint; the tree
+    // keeps one finger, so these are not safe to call concurrently with each other
+    std::pair<ConstIterator, bool> Insert(const ValueType& value, ConstIterator hint);
+    ConstIterator Find(const Key& key, ConstIterator hint);
+    // resolver: std::pair<bool, T> (const Key& key, const T* base, const T* ours, const T* theirs)
+    // is called for keys changed differently on both branches (nullptr means absent);
+    // it returns {true, value} to keep the key with value, which it may compute on the
+    // spot (e.g. ours + theirs - base for counters), or {false, T()} to leave the key out
+    template <class Resolver>
+    Version* Merge(Version* base, Version* ours, Version* theirs, Resolver resolver);
+    // two new versions derived from version: keys less than key, and the other keys
+    std::pair<Version*, Version*> Split(Version* version, const Key& key);
+    // new version derived from left_version, holding the elements of both;
+    // every key of left_version must be less than every key of right_version
+    Version* Join(Version* left_version, Version* right_version);
+    // new version without the keys in [lower, upper)
+    Version* DeleteRange(const Key& lower, const Key& upper, Version* dependent_version);
+    Version* DeleteRange(const Key& lower, const Key& upper);
     void RemoveVersion(Version* version);
     void Clear();
     const T& At(const Key& key, Version* version);
     ConstIterator Find(const Key& key, Version* version);
+    void FindMany(const std::vector<Key>& keys, Version* version, std::vector<ConstIterator>& out);
+    void AtMany(const std::vector<Key>& keys, Version* version, std::vector<T>& out);
+    // Find(key, versions[i]) for every i; the subtrees shared between versions are searched once
+    void HistoryOf(const Key& key, const std::vector<Version*>& versions, std::vector<ConstIterator>& out);
+    // the same, with the versions cut into thread_num consecutive runs searched in parallel
+    void HistoryOf(const Key& key, const std::vector<Version*>& versions, std::vector<ConstIterator>& out,
+        unsigned thread_num);
+    // aggregate of the values whose keys are in [lower, upper)
+    AggregateType RangeAggregate(const Key& lower, const Key& upper, Version* version);
     ConstIterator CBegin(Version* version);
     ConstIterator CEnd();
+    // O(1); CEnd() if version is empty
+    ConstIterator Min(Version* version);
+    ConstIterator Max(Version* version);
+    Version* GetVersion(VersionId id);
+    Version* LatestVersionAsOf(TimePoint time);
+    FrozenVersion<Key, T> Freeze(Version* version);
+    // the elements of version in key order as a key column and a value column, at most
+    // chunk_size of them at a time: sink(const Key* keys, const T* values, std::size_t size)
+    // is called for each chunk in turn, and the buffers are reused, so the memory needed
+    // does not grow with the version; see column_scan.hpp for scans over the columns
+    template <class Sink>
+    void ExportColumns(Version* version, Sink sink, std::size_t chunk_size = kColumnChunkSize);
+    // the same, appending the whole version to keys and values
+    void ExportColumns(Version* version, std::vector<Key>& keys, std::vector<T>& values);
+    // make equal subtrees of versions one shared subtree, also between versions
+    // built independently; needs std::hash<Key>, and invalidates iterators and hints
+    void Deduplicate(const std::vector<Version*>& versions);
+    // move the nodes only version reaches (those no shared node lies above) into one
+    // contiguous block in van Emde Boas order; shared nodes and the nodes below them
+    // stay where they are; invalidates iterators and hints
+    void Compact(Version* version);
+    // the versions CompactHotVersions compacts: read read_threshold times by Find/At
+    // and at least min_age old; a threshold of 0 stops counting reads
+    void SetCompactionThreshold(std::uint32_t read_threshold, Clock::duration min_age);
+    // compact every version over the threshold and return how many were compacted;
+    // updates never compact on their own, since Compact invalidates iterators and
+    // hints, so call this at a point where none are held
+    std::size_t CompactHotVersions();
+    // keep the nodes of paged-out versions in the pages of page_store (see page_store.hpp),
+    // which may serve several trees, one thread at a time, and must outlive them;
+    // Key and T must be trivially copyable
+    void SetPageStore(BufferPool* page_store);
+    // write the nodes of version to the page store, reusing the records of nodes stored
+    // before, and free those no resident version uses; the first operation on the version
+    // afterwards pages it back in; invalidates its iterators and hints
+    void PageOut(Version* version);
+    // read a paged-out version back, sharing the nodes still resident, so only the
+    // records of nodes no resident version uses are read
+    void PageIn(Version* version);
 
 #ifdef PRBT_TESTING
 protected:
 #else
 private:
 #endif
+    typedef ValueTraits<Key, T> Traits;
+    static const Key& KeyOf(const Node* node) { return Traits::KeyOf(node->value); }
+    static const T& MappedOf(const Node* node) { return Traits::MappedOf(node->value); }
+    // order of the nodes; equal keys are told apart by insertion order (kMulti)
+    static bool NodeLess(const Node* left, const Node* right)
+    {
+        return KeyOf(left) < KeyOf(right) || (!(KeyOf(right) < KeyOf(left)) && left->Precedes(*right));
+    }
+    Node* FindNode(Node* subtree_root, const Key& key);
     void LeftRotate(Node** subtree_root_node_ptr);
     void RightRotate(Node** subtree_root_nodet);
-    void InsertFixup(std::stack<Node**>& path);
+    std::size_t InsertFixup(SlotPath& path);
     Node* TreeMinimum(Node* sub_tree_root);
     Node* TreeMaximum(Node* sub_tree_root);
     Node* TreeSuccessor(Version* version, Node* node);
     Node* TreePredecessor(Version* version, Node* node);
-    void DeleteFixup(std::stack<Node**>& path);
+    void DeleteFixup(SlotPath& path);
     void CreateCopyAndPlant(Node** node_ptr);
-    Node* TreeMinimumTraverseSingleUse(Node* sub_tree_root, std::stack<Node*>& path);
+    std::pair<Node*, bool> InsertNode(Node** root_ptr, const ValueType& value,
+        const std::vector<FingerStep>* route = nullptr, bool is_append = false, std::size_t* rotated_depth = nullptr);
+    void MoveFingerTo(Version* version, Node* node);
+    void MoveFingerToInserted(Version* version, Node* node, std::size_t rotated_depth);
+    Node* MoveFinger(const Key& key, bool for_insert);
+    bool FingerCovers(const FingerStep& step, const Key& key, bool for_insert);
+    bool DeleteNode(Node** root_ptr, const Key& key);
+    bool DeleteExtremeNode(Node** root_ptr, bool is_minimum);
+    void DeleteAt(Node** node_ptr, SlotPath& path);
+    void DiffSubtrees(Node* base_root, Node* branch_root, std::vector<Difference>& differences);
+    void MergeKey(Node** root_ptr, const Key& key, const T* merged);
+    Node* TreeMinimumTraverseSingleUse(Node* sub_tree_root, NodePath& path);
+    Version* CreateVersion(Version* dependent_version);
+    void UpdateExtremes(Version* version, Node* known_leftmost, Node* known_rightmost);
+    Node* SpineEnd(Node* node, bool is_left, Node* known);
+    static void Prefetch(const void* address);
+    void UpdateAggregates(Node* subtree_root);
+    void UpdateAggregates(Node* subtree_root, std::true_type);
+    void UpdateAggregates(Node* subtree_root, std::false_type);
+    int BlackHeight(Node* subtree_root);
+    void PaintRootBlack(Node** root_ptr);
+    Node* JoinSubtrees(Node* left, int left_height, Node* middle, Node* right, int right_height, int& height);
+    Node* ConcatenateSubtrees(Node* left, int left_height, Node* right);
+    void SplitSubtree(Node* root, int height, const Key& key,
+        Node*& left, int& left_height, Node*& right, int& right_height);
+    void ReleaseSubtree(Node* subtree_root);
+    Node* CanonicalSubtree(Node* subtree_root, CanonicalNodeSet& canonical_nodes,
+        std::unordered_map<Node*, Node*>& canonical_of);
+    void ReplaceReference(Node** slot, Node* subtree_root);
+    void FreeNode(Node* node);
+    // these three see only the nodes Compact moves, treating shared nodes as nil
+    int SubtreeHeight(Node* subtree_root);
+    void VanEmdeBoasOrder(Node* subtree_root, int levels, std::vector<Node*>& order);
+    void CollectLevel(Node* subtree_root, int depth, std::vector<Node*>& level);
+    void RelocateSubtree(Node** slot, const std::unordered_map<Node*, Node*>& destination);
+    void MakeResident(Version* version) { if (version->root_ == nullptr) PageIn(version); }
+    StoredNodeId StoreSubtree(Node* subtree_root);
+    Node* LoadSubtree(StoredNodeId id);
+    void ReleaseStored(StoredNodeId id);
+    StoredNodeId AllocateStoredId();
+    void ReadStored(StoredNodeId id, StoredNode& stored);
+    void WriteStored(StoredNodeId id, const StoredNode& stored);
+    void SetLiveId(VersionId id);
+    void ClearLiveId(VersionId id);
+    Version* LiveVersionAtOrBefore(VersionId id);
+    static int HighestBit(std::uint64_t bits);
+    static std::size_t HistoryMemoSlot(const Node* node);
+    void HistoryOfRun(const Key& key, const std::vector<Version*>& versions,
+        std::size_t begin, std::size_t end, std::vector<ConstIterator>& out);
     // Node* root_;
     Node* nil_;
     Version* version_nil_;
+    std::vector<Version*> versions_;// indexed by version id; nullptr once removed
+    std::vector<TimePoint> timestamps_;// indexed by version id, kept after removal; nondecreasing
+    // level 0 has bit id % 64 of word id / 64 set while version id exists; each
+    // level above has a bit per word of the one below, set while that word is not 0,
+    // and the top level is a single word
+    std::vector<std::vector<std::uint64_t> > live_ids_;
+    std::vector<Version*> version_chunks_;// arrays of kVersionChunkSize records
+    Version* free_versions_;// records to reuse, linked by next_
+    std::map<std::uintptr_t, NodeArena> arenas_;// by address of the first node
+    std::uint32_t compaction_read_threshold_;// 0 if reads are not counted
+    Clock::duration compaction_min_age_;
+    std::uint64_t next_sequence_;// insertion order of equal keys (kMulti)
+    // path from the root of finger_version_ to the last position of a finger operation;
+    // nullptr and empty if none
+    Version* finger_version_;
+    std::vector<FingerStep> finger_;
+    BufferPool* page_store_;// nullptr if none
+    std::size_t stored_per_page_;// StoredNode records in a page
+    std::vector<PageId> stored_pages_;// page of records [i * stored_per_page_, (i + 1) * stored_per_page_)
+    std::vector<std::uint32_t> stored_use_counts_;// by StoredNodeId: parent records and versions pointing at it
+    std::vector<StoredNodeId> free_stored_ids_;
+    std::unordered_map<Node*, StoredNodeId> stored_id_of_;// resident nodes with a record
+    std::unordered_map<StoredNodeId, Node*> resident_of_;// records with a resident node
 };
 
+template <class Key, class Monoid = NoAggregate>
+using PersistentRedBlackSet = PersistentRedBlackTree<Key, SetMapped, Monoid>;
+
+template <class Key, class T, class Monoid = NoAggregate>
+using PersistentRedBlackMultimap = PersistentRedBlackTree<Key, T, Monoid, true>;
+
+template <class Key, class Monoid = NoAggregate>
+using PersistentRedBlackMultiset = PersistentRedBlackTree<Key, SetMapped, Monoid, true>;
+
 // ---------- definition ----------
 
-template <class Key, class T>
-PersistentRedBlackTree<Key, T>::PersistentRedBlackTree()
+template <class Key, class T, class Monoid, bool kMulti>
+constexpr typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::VersionId PersistentRedBlackTree<Key, T, Monoid, kMulti>::kNilVersionId;
+
+template <class Key, class T, class Monoid, bool kMulti>
+constexpr std::size_t PersistentRedBlackTree<Key, T, Monoid, kMulti>::kColumnChunkSize;
+
+template <class Key, class T, class Monoid, bool kMulti>
+constexpr int PersistentRedBlackTree<Key, T, Monoid, kMulti>::kDescentGroupSize;
+
+template <class Key, class T, class Monoid, bool kMulti>
+constexpr int PersistentRedBlackTree<Key, T, Monoid, kMulti>::kHistoryMemoSize;
+
+template <class Key, class T, class Monoid, bool kMulti>
+constexpr std::size_t PersistentRedBlackTree<Key, T, Monoid, kMulti>::kMaxPathLength;
+
+template <class Key, class T, class Monoid, bool kMulti>
+constexpr std::size_t PersistentRedBlackTree<Key, T, Monoid, kMulti>::kVersionChunkSize;
+
+template <class Key, class T, class Monoid, bool kMulti>
+constexpr typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::StoredNodeId PersistentRedBlackTree<Key, T, Monoid, kMulti>::kNilStoredNodeId;
+
+template <class Key, class T, class Monoid, bool kMulti>
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::PersistentRedBlackTree()
 {
     nil_ = new Node();
     nil_->color = Node::BLACK;
+    nil_->left = nil_->right = nil_;
+    next_sequence_ = 0;
+    finger_version_ = nullptr;
     version_nil_ = new Version();
     version_nil_->next_ = version_nil_->prev_ = version_nil_;
     version_nil_->root_ = nil_;
+    version_nil_->leftmost_ = version_nil_->rightmost_ = nil_;
+    versions_.push_back(nullptr);// kNilVersionId
+    timestamps_.push_back(TimePoint::min());
+    live_ids_.push_back(std::vector<std::uint64_t>(1, 0));
+    free_versions_ = nullptr;
+    compaction_read_threshold_ = 0;
+    compaction_min_age_ = Clock::duration::zero();
+    page_store_ = nullptr;
+    stored_per_page_ = 0;
 }
 
-template <class Key, class T>
-PersistentRedBlackTree<Key, T>::~PersistentRedBlackTree()
+template <class Key, class T, class Monoid, bool kMulti>
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::~PersistentRedBlackTree()
 {
+    std::size_t i;
+    // the records go with their pages, so nothing needs reading
+    for (i = 0; i < stored_pages_.size(); ++i) page_store_->Free(stored_pages_[i]);
+    page_store_ = nullptr;
+    stored_id_of_.clear();
+    resident_of_.clear();
     Clear();
+    for (i = 0; i < version_chunks_.size(); ++i) delete[] version_chunks_[i];
     delete version_nil_;
     delete nil_;
 }
 
-template <class Key, class T>
-void PersistentRedBlackTree<Key, T>::LeftRotate(Node** subtree_root_node_ptr) 
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::LeftRotate(Node** subtree_root_node_ptr) 
 {
     Node* new_root;
     new_root = (*subtree_root_node_ptr)->right;
@@ -131,8 +445,8 @@ void PersistentRedBlackTree<Key, T>::LeftRotate(Node** subtree_root_node_ptr)
     *subtree_root_node_ptr = new_root;
 }
 
-template <class Key, class T>
-void PersistentRedBlackTree<Key, T>::RightRotate(Node** subtree_root_node_ptr) 
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::RightRotate(Node** subtree_root_node_ptr) 
 {
     Node* new_root;
     new_root = (*subtree_root_node_ptr)->left;
@@ -141,120 +455,310 @@ void PersistentRedBlackTree<Key, T>::RightRotate(Node** subtree_root_node_ptr)
     *subtree_root_node_ptr = new_root;
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::ConstIterator PersistentRedBlackTree<Key, T>::Find
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator PersistentRedBlackTree<Key, T, Monoid, kMulti>::Find
     (const Key& key, Version* version)
 {
-    Node* now;
-    now = version->root_;
+    MakeResident(version);
+    if (compaction_read_threshold_ != 0) version->reads_.fetch_add(1, std::memory_order_relaxed);
+    return ConstIterator(FindNode(version->root_, key), this, version);
+}
+
+// the node with key, or nil_; the first inserted one if keys may be equal
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::FindNode
+    (Node* subtree_root, const Key& key)
+{
+    Node *now, *found;
+    now = subtree_root;
+    found = nil_;
     while (now != nil_)
     {
-        if (now->value.first == key)
-            break;
-        else if (now->value.first < key)
+        if (KeyOf(now) == key)
+        {
+            found = now;
+            if (kMulti == false) break;
+            now = now->left;// equal keys inserted earlier are on the left
+        }
+        else if (KeyOf(now) < key)
+        {
             now = now->right;
+        }
         else
+        {
             now = now->left;
+        }
     }
-    return ConstIterator(now, this, version);
+    return found;
 }
  
-template <class Key, class T>
-const T& PersistentRedBlackTree<Key, T>::At(const Key& key, Version* version)
+template <class Key, class T, class Monoid, bool kMulti>
+const T& PersistentRedBlackTree<Key, T, Monoid, kMulti>::At(const Key& key, Version* version)
 {
     Node* now;
-    now = version->root_;
-    while (now != nil_)
-    {
-        if (now->value.first == key)
-            return now->value.second;
-        else if (now->value.first < key)
-            now = now->right;
-        else
-            now = now->left;
-    }
+    MakeResident(version);
+    if (compaction_read_threshold_ != 0) version->reads_.fetch_add(1, std::memory_order_relaxed);
+    now = FindNode(version->root_, key);
+    if (now != nil_) return MappedOf(now);
     throw std::out_of_range("the container does not have an element with the specified key");
 }
 
-template <class Key, class T>
-std::pair<typename PersistentRedBlackTree<Key, T>::ConstIterator, bool> 
-    PersistentRedBlackTree<Key, T>::InsertOrAssign
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator, bool> 
+    PersistentRedBlackTree<Key, T, Monoid, kMulti>::InsertOrAssign
     (const ValueType& value)
 {
     return InsertOrAssign(value, version_nil_->next_);
 }
 
-template <class Key, class T>
-std::pair<typename PersistentRedBlackTree<Key, T>::ConstIterator, bool> 
-    PersistentRedBlackTree<Key, T>::InsertOrAssign
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator, bool> 
+    PersistentRedBlackTree<Key, T, Monoid, kMulti>::InsertOrAssign
     (const ValueType& value, Version* dependent_version)
 {
-    std::pair<ConstIterator, bool> insert_result;
-    insert_result = Insert(value, dependent_version);
-    if (insert_result.second == false) insert_result.first.node_->value.second = value.second;
-    return insert_result;
+    Version* new_version;
+    std::pair<Node*, bool> insert_result;
+    static_assert(kMulti == false, "InsertOrAssign needs unique keys; use Insert");
+    MakeResident(dependent_version);
+    new_version = CreateVersion(dependent_version);
+    insert_result = InsertNode(&(new_version->root_), value);
+    if (insert_result.second == false) Traits::AssignMapped(insert_result.first->value, value);
+    UpdateAggregates(new_version->root_);
+    UpdateExtremes(new_version, dependent_version->leftmost_, dependent_version->rightmost_);
+    return std::make_pair(ConstIterator(insert_result.first, this, new_version), insert_result.second);
 }
 
-template <class Key, class T>
-std::pair<typename PersistentRedBlackTree<Key, T>::ConstIterator, bool> 
-    PersistentRedBlackTree<Key, T>::Insert
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator, bool> 
+    PersistentRedBlackTree<Key, T, Monoid, kMulti>::Insert
     (const ValueType& value)
 {
     return Insert(value, version_nil_->next_);
 }
 
-template <class Key, class T>
-std::pair<typename PersistentRedBlackTree<Key, T>::ConstIterator, bool> 
-    PersistentRedBlackTree<Key, T>::Insert
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator, bool> 
+    PersistentRedBlackTree<Key, T, Monoid, kMulti>::Insert
     (const ValueType& value, Version* dependent_version)
 {
-    Node *dep_now, **new_next_ptr;
     Version* new_version;
-    std::stack<Node**> path;
-    new_version = new Version(version_nil_->next_, version_nil_, nil_);
-    version_nil_->next_ = new_version;
-    new_version->next_->prev_ = new_version;
-    new_next_ptr = &(new_version->root_);
-    // dep_now = dependent_version == nullptr ? nil_ : dependent_version->root_;
-    dep_now = dependent_version->root_;
-    while (dep_now != nil_)
+    std::pair<Node*, bool> insert_result;
+    bool is_append;
+    MakeResident(dependent_version);
+    // past the maximum, the search is the right spine and needs no comparison
+    is_append = dependent_version->rightmost_ != nil_ &&
+        (kMulti ? !(Traits::KeyOf(value) < KeyOf(dependent_version->rightmost_)) :
+        KeyOf(dependent_version->rightmost_) < Traits::KeyOf(value));
+    new_version = CreateVersion(dependent_version);
+    insert_result = InsertNode(&(new_version->root_), value, nullptr, is_append);
+    UpdateAggregates(new_version->root_);
+    UpdateExtremes(new_version, dependent_version->leftmost_, dependent_version->rightmost_);
+    return std::make_pair(ConstIterator(insert_result.first, this, new_version), insert_result.second);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator, bool> 
+    PersistentRedBlackTree<Key, T, Monoid, kMulti>::Insert
+    (const ValueType& value, ConstIterator hint)
+{
+    Version* new_version;
+    std::pair<Node*, bool> insert_result;
+    std::size_t rotated_depth;
+    if (finger_version_ != hint.version_ || finger_.empty() || finger_.back().node != hint.node_)
+        MoveFingerTo(hint.version_, hint.node_);
+    MoveFinger(Traits::KeyOf(value), true);
+    new_version = CreateVersion(hint.version_);
+    insert_result = InsertNode(&(new_version->root_), value, &finger_, false, &rotated_depth);
+    UpdateAggregates(new_version->root_);
+    UpdateExtremes(new_version, hint.version_->leftmost_, hint.version_->rightmost_);
+    MoveFingerToInserted(new_version, insert_result.first, rotated_depth);
+    return std::make_pair(ConstIterator(insert_result.first, this, new_version), insert_result.second);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator PersistentRedBlackTree<Key, T, Monoid, kMulti>::Find
+    (const Key& key, ConstIterator hint)
+{
+    if (finger_version_ != hint.version_ || finger_.empty() || finger_.back().node != hint.node_)
+        MoveFingerTo(hint.version_, hint.node_);
+    return ConstIterator(MoveFinger(key, false), this, hint.version_);
+}
+
+// point the finger at node of version
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::MoveFingerTo(Version* version, Node* node)
+{
+    Node *now, *lower, *upper;
+    finger_version_ = version;
+    finger_.clear();
+    if (node == nil_) return;
+    now = version->root_;
+    lower = upper = nullptr;
+    while (now != nil_)
     {
-        *new_next_ptr = new Node(dep_now->value);
-        path.push(new_next_ptr);
-        (*new_next_ptr)->color = dep_now->color;
-        if (value.first == dep_now->value.first)
+        finger_.push_back(FingerStep{now, lower, upper});
+        if (now == node) break;
+        if (NodeLess(node, now))
         {
-            (*new_next_ptr)->left = dep_now->left;
-            ++dep_now->left->use_count;
-            (*new_next_ptr)->right = dep_now->right;
-            ++dep_now->right->use_count;
-            return std::make_pair(ConstIterator(*new_next_ptr, this, new_version), false);
+            upper = now;
+            now = now->left;
+        }
+        else
+        {
+            lower = now;
+            now = now->right;
+        }
+    }
+}
+
+// point the finger at node of version, which InsertNode has just reached along the
+// route in finger_: above rotated_depth the path of version is made of the copies of
+// the route's nodes, so it is followed by pointer, and only the few steps below the
+// highest rotation compare nodes
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::MoveFingerToInserted(Version* version, Node* node, std::size_t rotated_depth)
+{
+    Node *now, *lower, *upper;
+    std::size_t route_size, depth;
+    bool go_left;
+    route_size = finger_.size();
+    finger_version_ = version;
+    now = version->root_;
+    lower = upper = nullptr;
+    for (depth = 0; now != nil_; ++depth)
+    {
+        if (depth >= rotated_depth)
+            go_left = now != node && NodeLess(node, now);
+        else if (depth + 1 < route_size)
+            go_left = finger_[depth + 1].node == finger_[depth].node->left;
+        else
+            go_left = now->left == node;// node hangs below the end of the route
+        if (depth < finger_.size())
+            finger_[depth] = FingerStep{now, lower, upper};
+        else
+            finger_.push_back(FingerStep{now, lower, upper});
+        if (now == node) break;
+        if (go_left)
+        {
+            upper = now;
+            now = now->left;
+        }
+        else
+        {
+            lower = now;
+            now = now->right;
+        }
+    }
+    finger_.resize(depth + 1);
+}
+
+// whether the search for key from step.node stays within its subtree; a search
+// for insertion in a container with equal keys goes after the equal keys
+template <class Key, class T, class Monoid, bool kMulti>
+bool PersistentRedBlackTree<Key, T, Monoid, kMulti>::FingerCovers(const FingerStep& step, const Key& key, bool for_insert)
+{
+    if (step.upper != nullptr && !(key < KeyOf(step.upper))) return false;
+    if (step.lower == nullptr) return true;
+    return kMulti && for_insert ? !(key < KeyOf(step.lower)) : KeyOf(step.lower) < key;
+}
+
+// climb from the finger to the lowest node whose subtree covers key, then
+// descend from there; the finger ends at the node with key (the first inserted
+// one if keys may be equal), or at the last node of the search; returns the
+// node with key, or nil_
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::MoveFinger
+    (const Key& key, bool for_insert)
+{
+    Node *now, *child, *found;
+    std::size_t found_depth;
+    bool go_left;
+    while (finger_.size() > 1 && FingerCovers(finger_.back(), key, for_insert) == false) finger_.pop_back();
+    if (finger_.empty())
+    {
+        if (finger_version_->root_ == nil_) return nil_;
+        finger_.push_back(FingerStep{finger_version_->root_, nullptr, nullptr});
+    }
+    found = nil_;
+    found_depth = 0;
+    now = finger_.back().node;
+    while (true)
+    {
+        if (KeyOf(now) == key && for_insert == false)
+        {
+            found = now;
+            found_depth = finger_.size();
+            if (kMulti == false) break;
+        }
+        else if (KeyOf(now) == key && kMulti == false)
+        {
+            break;
+        }
+        // equal keys inserted earlier are on the left
+        go_left = kMulti && for_insert == false ? !(KeyOf(now) < key) : key < KeyOf(now);
+        child = go_left ? now->left : now->right;
+        if (child == nil_) break;
+        finger_.push_back(FingerStep{child, go_left ? finger_.back().lower : now, go_left ? now : finger_.back().upper});
+        now = child;
+    }
+    if (found != nil_) finger_.resize(found_depth);
+    return found;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node*, bool> PersistentRedBlackTree<Key, T, Monoid, kMulti>::InsertNode
+    (Node** root_ptr, const ValueType& value, const std::vector<FingerStep>* route, bool is_append,
+    std::size_t* rotated_depth)
+{
+    Node **now_ptr, *inserted;
+    SlotPath path;
+    std::size_t depth;
+    now_ptr = root_ptr;
+    depth = 0;
+    while (*now_ptr != nil_)
+    {
+        CreateCopyAndPlant(now_ptr);
+        path.push(now_ptr);
+        if (is_append)
+        {
+            now_ptr = &((*now_ptr)->right);
+        }
+        else if (route != nullptr && ++depth < route->size())
+        {
+            // route is the search path of value in the version being copied; follow it without comparing
+            if ((*now_ptr)->left == (*route)[depth].node)
+                now_ptr = &((*now_ptr)->left);
+            else
+                now_ptr = &((*now_ptr)->right);
+        }
+        else if (kMulti == false && Traits::KeyOf(value) == KeyOf(*now_ptr))
+        {
+            if (rotated_depth != nullptr) *rotated_depth = kMaxPathLength;
+            return std::make_pair(*now_ptr, false);
         }
-        else if (value.first < dep_now->value.first)
+        else if (Traits::KeyOf(value) < KeyOf(*now_ptr))
         {
-            (*new_next_ptr)->right = dep_now->right;
-            ++dep_now->right->use_count;
-            dep_now = dep_now->left;
-            new_next_ptr = &((*new_next_ptr)->left);
+            now_ptr = &((*now_ptr)->left);
         }
         else
         {
-            (*new_next_ptr)->left = dep_now->left;
-            ++dep_now->left->use_count;
-            dep_now = dep_now->right;
-            new_next_ptr = &((*new_next_ptr)->right);
+            now_ptr = &((*now_ptr)->right);
         }
     }
-    *new_next_ptr = new Node(value);
-    path.push(new_next_ptr);
-    (*new_next_ptr)->color = Node::RED;
-    (*new_next_ptr)->left = (*new_next_ptr)->right = nil_;
-    InsertFixup(path);
-    return std::make_pair(ConstIterator(*new_next_ptr, this, new_version), true);
+    inserted = *now_ptr = new Node(value);
+    inserted->Stamp(next_sequence_);// after every equal key (kMulti)
+    path.push(now_ptr);
+    inserted->color = Node::RED;
+    inserted->left = inserted->right = nil_;
+    depth = InsertFixup(path);// may rotate inserted away from *now_ptr
+    if (rotated_depth != nullptr) *rotated_depth = depth;
+    return std::make_pair(inserted, true);
 }
 
-template <class Key, class T>
-void PersistentRedBlackTree<Key, T>::InsertFixup(std::stack<Node**>& path)
+// returns the depth of the highest subtree it rotated, or kMaxPathLength if it
+// only recolored; the path above that depth keeps its shape
+template <class Key, class T, class Monoid, bool kMulti>
+std::size_t PersistentRedBlackTree<Key, T, Monoid, kMulti>::InsertFixup(SlotPath& path)
 {
     Node **uncle_ptr, **grandparent_ptr, **parent_ptr, *node, *tmp;
     node = *path.top();
@@ -292,8 +796,8 @@ void PersistentRedBlackTree<Key, T>::InsertFixup(std::stack<Node**>& path)
                 (*parent_ptr)->color = Node::BLACK;
                 (*grandparent_ptr)->color = Node::RED;
                 RightRotate(grandparent_ptr);
-                // finish
-                break;
+                // finish; grandparent was at the depth of the slots left in path
+                return path.size();
             }
         }
         else
@@ -321,17 +825,17 @@ void PersistentRedBlackTree<Key, T>::InsertFixup(std::stack<Node**>& path)
                 (*parent_ptr)->color = Node::BLACK;
                 (*grandparent_ptr)->color = Node::RED;
                 LeftRotate(grandparent_ptr);
-                // finish
-                break;
+                // finish; grandparent was at the depth of the slots left in path
+                return path.size();
             }
         }
         
     }
-    // root_->color = Node::BLACK;
+    return kMaxPathLength;
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::TreeMinimum
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::TreeMinimum
     (Node* sub_tree_root)
 {
     while (sub_tree_root->left != nil_)
@@ -339,9 +843,9 @@ typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::T
     return sub_tree_root;
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::TreeMinimumTraverseSingleUse
-    (Node* sub_tree_root, std::stack<Node*>& path)
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::TreeMinimumTraverseSingleUse
+    (Node* sub_tree_root, NodePath& path)
 {
     while (sub_tree_root->left != nil_ && sub_tree_root->left->use_count == 0)
     {
@@ -351,8 +855,8 @@ typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::T
     return sub_tree_root;
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::TreeMaximum
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::TreeMaximum
     (Node* sub_tree_root)
 {
     while (sub_tree_root->right != nil_)
@@ -360,8 +864,8 @@ typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::T
     return sub_tree_root;
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::TreeSuccessor
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::TreeSuccessor
     (Version* version, Node* node)
 {
     Node *now, *succ;
@@ -370,11 +874,11 @@ typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::T
     succ = nil_;
     while (now != nil_)
     {
-        if (now->value.first == node->value.first)
+        if (now == node)
         {
             return succ;
         }
-        else if (now->value.first > node->value.first)
+        else if (NodeLess(node, now))
         {
             succ = now;
             now = now->left;
@@ -387,8 +891,8 @@ typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::T
     throw std::runtime_error("node is not found in the version");
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::TreePredecessor
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::TreePredecessor
     (Version* version, Node* node)
 {
     Node *now, *prev;
@@ -397,11 +901,11 @@ typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::T
     prev = nil_;
     while (now != nil_)
     {
-        if (now->value.first == node->value.first)
+        if (now == node)
         {
             return prev;
         }
-        else if (now->value.first >node->value.first)
+        else if (NodeLess(node, now))
         {
             now = now->left;
         }
@@ -414,121 +918,184 @@ typename PersistentRedBlackTree<Key, T>::Node* PersistentRedBlackTree<Key, T>::T
     throw std::runtime_error("node is not found in the version");
 }
 
-template <class Key, class T>
-std::pair<typename PersistentRedBlackTree<Key, T>::Version*, bool> 
-PersistentRedBlackTree<Key, T>::Delete(const Key& key)
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*, bool> 
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::Delete(const Key& key)
 {
     return Delete(key, version_nil_->next_);
 }
 
-template <class Key, class T>
-std::pair<typename PersistentRedBlackTree<Key, T>::Version*, bool> 
-PersistentRedBlackTree<Key, T>::Delete(const Key& key, Version* dependent_version)
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*, bool> 
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::Delete(const Key& key, Version* dependent_version)
 {
-    Node *dep_now, **new_next_ptr, *deleted;
     Version* new_version;
-    std::stack<Node**> path;
-    bool is_black_deleted;
-    new_version = new Version(version_nil_->next_, version_nil_, nil_);
-    version_nil_->next_ = new_version;
-    new_version->next_->prev_ = new_version;
-    new_next_ptr = &(new_version->root_);
-    // dep_now = dependent_version == nullptr ? nil_ : dependent_version->root_;
-    dep_now = dependent_version->root_;
-    while (dep_now != nil_)
+    Node *known_leftmost, *known_rightmost;
+    bool deleted;
+    MakeResident(dependent_version);
+    new_version = CreateVersion(dependent_version);
+    deleted = DeleteNode(&(new_version->root_), key);
+    UpdateAggregates(new_version->root_);
+    // an end is kept unless it may be the deleted element
+    known_leftmost = dependent_version->leftmost_;
+    known_rightmost = dependent_version->rightmost_;
+    if (known_leftmost != nil_ && KeyOf(known_leftmost) == key) known_leftmost = nullptr;
+    if (known_rightmost != nil_ && KeyOf(known_rightmost) == key) known_rightmost = nullptr;
+    UpdateExtremes(new_version, known_leftmost, known_rightmost);
+    return std::make_pair(new_version, deleted);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*, bool> 
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::PopMin()
+{
+    return PopMin(version_nil_->next_);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*, bool> 
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::PopMax()
+{
+    return PopMax(version_nil_->next_);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*, bool> 
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::PopMin(Version* dependent_version)
+{
+    Version* new_version;
+    bool deleted;
+    MakeResident(dependent_version);
+    new_version = CreateVersion(dependent_version);
+    deleted = DeleteExtremeNode(&(new_version->root_), true);
+    UpdateAggregates(new_version->root_);
+    // the new minimum is next to the spine, so finding it costs O(1)
+    UpdateExtremes(new_version, nullptr, dependent_version->rightmost_);
+    return std::make_pair(new_version, deleted);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*, bool> 
+PersistentRedBlackTree<Key, T, Monoid, kMulti>::PopMax(Version* dependent_version)
+{
+    Version* new_version;
+    bool deleted;
+    MakeResident(dependent_version);
+    new_version = CreateVersion(dependent_version);
+    deleted = DeleteExtremeNode(&(new_version->root_), false);
+    UpdateAggregates(new_version->root_);
+    UpdateExtremes(new_version, dependent_version->leftmost_, nullptr);
+    return std::make_pair(new_version, deleted);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+bool PersistentRedBlackTree<Key, T, Monoid, kMulti>::DeleteNode(Node** root_ptr, const Key& key)
+{
+    Node **now_ptr, *target;
+    SlotPath path;
+    // equal keys are told apart by node: locate the first inserted one, then descend to it
+    target = kMulti ? FindNode(*root_ptr, key) : nullptr;
+    if (target == nil_) return false;
+    now_ptr = root_ptr;
+    while (*now_ptr != nil_)
     {
-        if (key == dep_now->value.first)
-        {
-            // found the node; perform delete
-            is_black_deleted = dep_now->color == Node::BLACK;
-            if (dep_now->left == nil_)
-            {
-                *new_next_ptr = dep_now->right;
-                ++dep_now->right->use_count;
-                path.push(new_next_ptr);// push replaced_replaced
-            }
-            else if (dep_now->right == nil_)
-            {
-                *new_next_ptr = dep_now->left;
-                ++dep_now->left->use_count;
-                path.push(new_next_ptr);// push replaced_replaced
-            }
-            else
-            {
-                *new_next_ptr = new Node();// place holder
-                deleted = *new_next_ptr;
-                path.push(new_next_ptr);
-                (*new_next_ptr)->color = dep_now->color;
-                (*new_next_ptr)->left = dep_now->left;
-                ++dep_now->left->use_count;
-                dep_now = dep_now->right;
-                new_next_ptr = &((*new_next_ptr)->right);
-                // find successor
-                while (dep_now->left != nil_)
-                {
-                    *new_next_ptr = new Node(dep_now->value);
-                    path.push(new_next_ptr);
-                    (*new_next_ptr)->color = dep_now->color;
-                    (*new_next_ptr)->right = dep_now->right;
-                    ++dep_now->right->use_count;
-                    dep_now = dep_now->left;
-                    new_next_ptr = &((*new_next_ptr)->left);
-                }
-                // now, dep_now is successor
-                const_cast<Key&>(deleted->value.first) = dep_now->value.first;
-                deleted->value.second = dep_now->value.second;
-                is_black_deleted = dep_now->color == Node::BLACK;
-                *new_next_ptr = dep_now->right;
-                ++dep_now->right->use_count;
-                path.push(new_next_ptr);// push replaced_replaced
-            }
-            if (is_black_deleted)
-            // In order to maintain property 5,
-            // "replaced_replaced" node has extra black (either "doubly black" or "red-and-black", contributes either 2 or 1)
-                DeleteFixup(path);
-            return std::make_pair(new_version, true);// finish
-        }
-        *new_next_ptr = new Node(dep_now->value);
-        path.push(new_next_ptr);
-        (*new_next_ptr)->color = dep_now->color;
-        if (key < dep_now->value.first)
-        {
-            (*new_next_ptr)->right = dep_now->right;
-            ++dep_now->right->use_count;
-            dep_now = dep_now->left;
-            new_next_ptr = &((*new_next_ptr)->left);
-        }
+        if (kMulti ? *now_ptr == target : key == KeyOf(*now_ptr)) break;
+        CreateCopyAndPlant(now_ptr);
+        path.push(now_ptr);
+        if (kMulti ? NodeLess(target, *now_ptr) : key < KeyOf(*now_ptr))
+            now_ptr = &((*now_ptr)->left);
         else
+            now_ptr = &((*now_ptr)->right);
+    }
+    if (*now_ptr == nil_) return false;
+    DeleteAt(now_ptr, path);
+    return true;
+}
+
+// delete the minimum (maximum) node: follow the left (right) spine without comparing
+template <class Key, class T, class Monoid, bool kMulti>
+bool PersistentRedBlackTree<Key, T, Monoid, kMulti>::DeleteExtremeNode(Node** root_ptr, bool is_minimum)
+{
+    Node** now_ptr;
+    SlotPath path;
+    if (*root_ptr == nil_) return false;
+    now_ptr = root_ptr;
+    while ((is_minimum ? (*now_ptr)->left : (*now_ptr)->right) != nil_)
+    {
+        CreateCopyAndPlant(now_ptr);
+        path.push(now_ptr);
+        now_ptr = is_minimum ? &((*now_ptr)->left) : &((*now_ptr)->right);
+    }
+    DeleteAt(now_ptr, path);
+    return true;
+}
+
+// delete *node_ptr, whose ancestors are on path and owned
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::DeleteAt(Node** now_ptr, SlotPath& path)
+{
+    Node *deleted, *replaced;
+    bool is_black_deleted;
+    if ((*now_ptr)->left != nil_ && (*now_ptr)->right != nil_)
+    {
+        CreateCopyAndPlant(now_ptr);
+        deleted = *now_ptr;
+        path.push(now_ptr);
+        now_ptr = &(deleted->right);
+        // find successor
+        while ((*now_ptr)->left != nil_)
         {
-            (*new_next_ptr)->left = dep_now->left;
-            ++dep_now->left->use_count;
-            dep_now = dep_now->right;
-            new_next_ptr = &((*new_next_ptr)->right);
+            CreateCopyAndPlant(now_ptr);
+            path.push(now_ptr);
+            now_ptr = &((*now_ptr)->left);
         }
+        // now, *now_ptr is successor; move it into the place of the deleted node
+        Traits::Assign(deleted->value, (*now_ptr)->value);
+        static_cast<InsertionOrder<kMulti>&>(*deleted) = **now_ptr;
+    }
+    // now, *now_ptr has at most one child and is spliced out
+    deleted = *now_ptr;
+    is_black_deleted = deleted->color == Node::BLACK;
+    replaced = deleted->left == nil_ ? deleted->right : deleted->left;
+    *now_ptr = replaced;
+    path.push(now_ptr);// push replaced_replaced
+    if (deleted->use_count > 0)
+    {
+        // still used by other versions
+        --deleted->use_count;
+        ++replaced->use_count;
+    }
+    else
+    {
+        FreeNode(deleted);
     }
-    *new_next_ptr = nil_;
-    return std::make_pair(new_version, false);
+    if (is_black_deleted)
+    // In order to maintain property 5,
+    // "replaced_replaced" node has extra black (either "doubly black" or "red-and-black", contributes either 2 or 1)
+        DeleteFixup(path);
 }
 
-template <class Key, class T>
-void PersistentRedBlackTree<Key, T>::CreateCopyAndPlant(Node** node_ptr)
+// make *node_ptr owned only by the tree being built; a node which is
+// still used by other versions (use_count > 0) is replaced by a copy
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::CreateCopyAndPlant(Node** node_ptr)
 {
     Node *tmp;
     tmp = *node_ptr;
+    if (tmp->use_count == 0) return;
     --tmp->use_count;
-    *node_ptr = new Node((*node_ptr)->value);
-    (*node_ptr)->color = tmp->color;
-    (*node_ptr)->left = tmp->left;
+    *node_ptr = new Node(*tmp);
+    (*node_ptr)->use_count = 0;
     ++tmp->left->use_count;
-    (*node_ptr)->right = tmp->right;
     ++tmp->right->use_count;
 }
 
-template <class Key, class T>
-void PersistentRedBlackTree<Key, T>::DeleteFixup(std::stack<Node**>& path)
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::DeleteFixup(SlotPath& path)
 {
-    Node **sibling_ptr, **parent_ptr, *node;
-    node = *path.top();
+    Node **sibling_ptr, **parent_ptr, **node_ptr, *node;
+    node_ptr = path.top();
+    node = *node_ptr;
     path.pop();// now, top is parent of node
     while (path.empty() == false /* node != root_ */ && node->color == Node::BLACK)
     {
@@ -553,6 +1120,7 @@ void PersistentRedBlackTree<Key, T>::DeleteFixup(std::stack<Node**>& path)
                 CreateCopyAndPlant(sibling_ptr);
                 // perform case 2
                 (*sibling_ptr)->color = Node::RED;
+                node_ptr = parent_ptr;
                 node = *parent_ptr;
             }
             else
@@ -600,6 +1168,7 @@ void PersistentRedBlackTree<Key, T>::DeleteFixup(std::stack<Node**>& path)
                 CreateCopyAndPlant(sibling_ptr);
                 // perform case 2
                 (*sibling_ptr)->color = Node::RED;
+                node_ptr = parent_ptr;
                 node = *parent_ptr;
             }
             else
@@ -629,18 +1198,29 @@ void PersistentRedBlackTree<Key, T>::DeleteFixup(std::stack<Node**>& path)
             }
         }
     }
-    node->color = Node::BLACK;
+    if (node->color == Node::RED)
+    {
+        // node may still be shared with the dependent version
+        CreateCopyAndPlant(node_ptr);
+        (*node_ptr)->color = Node::BLACK;
+    }
 }
 
-template <class Key, class T>
-void PersistentRedBlackTree<Key, T>::RemoveVersion(Version* version)
+// drop one reference to subtree_root, freeing the nodes no other version uses
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::ReleaseSubtree(Node* subtree_root)
 {
     Node *now, *parent;
-    std::stack<Node*> path;
-    if (version->root_ != nil_) 
+    NodePath path;
+    if (subtree_root->use_count > 0)
+    {
+        // shared with another version
+        --subtree_root->use_count;
+    }
+    else if (subtree_root != nil_) 
     {
         path.push(nil_);
-        now = TreeMinimumTraverseSingleUse(version->root_, path);
+        now = TreeMinimumTraverseSingleUse(subtree_root, path);
         --now->left->use_count;
         while (now != nil_)
         {
@@ -655,38 +1235,1268 @@ void PersistentRedBlackTree<Key, T>::RemoveVersion(Version* version)
             parent = path.top();
             while (parent != nil_ && parent->right == now)
             {
-                delete now;
+                FreeNode(now);
                 now = parent;
                 path.pop();
                 parent = path.top();
             }
-            delete now;
+            FreeNode(now);
             now = parent;
             path.pop();
         }
-        version->root_ = nil_;
     }
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::RemoveVersion(Version* version)
+{
+    if (version == finger_version_)
+    {
+        finger_version_ = nullptr;
+        finger_.clear();
+    }
+    if (version->root_ != nullptr) ReleaseSubtree(version->root_);
+    if (page_store_ != nullptr) ReleaseStored(version->stored_root_);
     version->prev_->next_ = version->next_;
     version->next_->prev_ = version->prev_;
-    delete version;
+    versions_[version->id_] = nullptr;
+    ClearLiveId(version->id_);
+    version->next_ = free_versions_;
+    free_versions_ = version;
 }
 
-template <class Key, class T>
-void PersistentRedBlackTree<Key, T>::Clear()
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::Clear()
 {
     while (version_nil_->next_ != version_nil_) RemoveVersion(version_nil_->next_);
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::ConstIterator PersistentRedBlackTree<Key, T>::CBegin(Version* version)
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator PersistentRedBlackTree<Key, T, Monoid, kMulti>::CBegin(Version* version)
+{
+    MakeResident(version);
+    return ConstIterator(version->leftmost_, this, version);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator PersistentRedBlackTree<Key, T, Monoid, kMulti>::Min(Version* version)
+{
+    MakeResident(version);
+    return ConstIterator(version->leftmost_, this, version);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator PersistentRedBlackTree<Key, T, Monoid, kMulti>::Max(Version* version)
 {
-    return ConstIterator(TreeMinimum(version->root_), this, version);
+    MakeResident(version);
+    return ConstIterator(version->rightmost_, this, version);
 }
 
-template <class Key, class T>
-typename PersistentRedBlackTree<Key, T>::ConstIterator PersistentRedBlackTree<Key, T>::CEnd()
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator PersistentRedBlackTree<Key, T, Monoid, kMulti>::CEnd()
 {
     return ConstIterator(nil_, this, version_nil_);
 }
 
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::CreateVersion
+    (Version* dependent_version)
+{
+    Version* new_version;
+    TimePoint now;
+    std::size_t i;
+    if (free_versions_ == nullptr)
+    {
+        version_chunks_.push_back(new Version[kVersionChunkSize]);
+        for (i = 0; i < kVersionChunkSize; ++i)
+        {
+            version_chunks_.back()[i].next_ = free_versions_;
+            free_versions_ = version_chunks_.back() + i;
+        }
+    }
+    new_version = free_versions_;
+    free_versions_ = free_versions_->next_;
+    new_version->next_ = version_nil_->next_;
+    new_version->prev_ = version_nil_;
+    new_version->root_ = dependent_version->root_;
+    new_version->reads_.store(0, std::memory_order_relaxed);
+    new_version->stored_root_ = kNilStoredNodeId;
+    ++dependent_version->root_->use_count;// shared until the first path copy
+    new_version->leftmost_ = dependent_version->leftmost_;
+    new_version->rightmost_ = dependent_version->rightmost_;
+    version_nil_->next_ = new_version;
+    new_version->next_->prev_ = new_version;
+    new_version->id_ = versions_.size();
+    new_version->parent_id_ = dependent_version->id_;
+    // keep timestamps ordered like ids even if the system clock steps back
+    now = Clock::now();
+    if (now < timestamps_.back()) now = timestamps_.back();
+    new_version->timestamp_ = now;
+    versions_.push_back(new_version);
+    timestamps_.push_back(now);
+    SetLiveId(new_version->id_);
+    return new_version;
+}
+
+// called once version is built; a known end is the one of the version it
+// derives from, given only if that element is still in version
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::UpdateExtremes
+    (Version* version, Node* known_leftmost, Node* known_rightmost)
+{
+    version->leftmost_ = SpineEnd(version->root_, true, known_leftmost);
+    version->rightmost_ = SpineEnd(version->root_, false, known_rightmost);
+}
+
+// end of the left (right) spine below node; the nodes copied or created for
+// the version come first on it, and a shared node below them holds the same
+// subtree as in the dependent version, whose end is known unless nullptr
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::SpineEnd
+    (Node* node, bool is_left, Node* known)
+{
+    Node* child;
+    if (node == nil_) return nil_;
+    while (true)
+    {
+        if (known != nullptr && node->use_count > 0) return known;
+        child = is_left ? node->left : node->right;
+        if (child == nil_) return node;
+        node = child;
+    }
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::GetVersion(VersionId id)
+{
+    return id < versions_.size() ? versions_[id] : nullptr;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::LatestVersionAsOf
+    (TimePoint time)
+{
+    VersionId id;
+    // the last version created by time, then the last one of those not removed
+    id = std::upper_bound(timestamps_.begin() + 1, timestamps_.end(), time) - timestamps_.begin() - 1;
+    return LiveVersionAtOrBefore(id);
+}
+
+// sets the bit of id up the levels of live_ids_ until a word that was already
+// not 0; ids come in increasing order, so a level grows by at most a word
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::SetLiveId(VersionId id)
+{
+    std::size_t level, word;
+    bool was_empty;
+    for (level = 0; level < live_ids_.size(); ++level)
+    {
+        word = id / 64;
+        if (word == live_ids_[level].size()) live_ids_[level].push_back(0);
+        was_empty = live_ids_[level][word] == 0;
+        live_ids_[level][word] |= std::uint64_t(1) << (id % 64);
+        if (was_empty == false) return;
+        // the top level outgrew its word
+        if (level + 1 == live_ids_.size() && live_ids_[level].size() > 1)
+            live_ids_.push_back(std::vector<std::uint64_t>(1, live_ids_[level][0] != 0 ? 1 : 0));
+        id = word;
+    }
+}
+
+// clears the bit of id up the levels of live_ids_ while its word becomes 0
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::ClearLiveId(VersionId id)
+{
+    std::size_t level;
+    for (level = 0; level < live_ids_.size(); ++level)
+    {
+        live_ids_[level][id / 64] &= ~(std::uint64_t(1) << (id % 64));
+        if (live_ids_[level][id / 64] != 0) return;
+        id /= 64;
+    }
+}
+
+// the version with the greatest id not above id which is not removed, or
+// nullptr; climbs the levels of live_ids_ to the first word with a set bit at or
+// before the position of id, then goes down the highest set bits, so it reads
+// at most two words per level however many versions were removed
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::LiveVersionAtOrBefore
+    (VersionId id)
+{
+    std::size_t level;
+    std::uint64_t bits;
+    for (level = 0; ; ++level)
+    {
+        bits = live_ids_[level][id / 64] & (~std::uint64_t(0) >> (63 - id % 64));
+        if (bits != 0) break;
+        if (id < 64) return nullptr;
+        id = id / 64 - 1;// the words before the one of id
+    }
+    id = id / 64 * 64 + HighestBit(bits);
+    while (level > 0)
+    {
+        --level;
+        id = id * 64 + HighestBit(live_ids_[level][id]);
+    }
+    return versions_[id];
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+int PersistentRedBlackTree<Key, T, Monoid, kMulti>::HighestBit(std::uint64_t bits)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(bits);
+#else
+    int bit;
+    bit = 63;
+    while ((bits >> bit) == 0) --bit;
+    return bit;
+#endif
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::DiffSubtrees
+    (Node* base_root, Node* branch_root, std::vector<Difference>& differences)
+{
+    // in-order cursors: what is left of a tree is the "pending" subtree,
+    // followed by each node on the path (top first) and its right subtree
+    Node *base_pending, *branch_pending, *base_node, *branch_node;
+    NodePath base_path, branch_path;
+    bool expand_base, expand_branch;
+    base_pending = base_root;
+    branch_pending = branch_root;
+    while (true)
+    {
+        if (base_pending == branch_pending)
+        {
+            // shared subtree; nothing changed inside it
+            base_pending = branch_pending = nil_;
+        }
+        else if (base_pending != nil_ && branch_pending != nil_)
+        {
+            // the subtree with the greater root key may contain the other one
+            expand_base = !(KeyOf(base_pending) < KeyOf(branch_pending));
+            expand_branch = !(KeyOf(branch_pending) < KeyOf(base_pending));
+            if (expand_base)
+            {
+                base_path.push(base_pending);
+                base_pending = base_pending->left;
+            }
+            if (expand_branch)
+            {
+                branch_path.push(branch_pending);
+                branch_pending = branch_pending->left;
+            }
+            continue;
+        }
+        if (base_pending != nil_)
+        {
+            base_path.push(base_pending);
+            base_pending = base_pending->left;
+            continue;
+        }
+        if (branch_pending != nil_)
+        {
+            branch_path.push(branch_pending);
+            branch_pending = branch_pending->left;
+            continue;
+        }
+        // now, both cursors stop at a single node (or the end)
+        if (base_path.empty() && branch_path.empty()) break;
+        base_node = base_path.empty() ? nil_ : base_path.top();
+        branch_node = branch_path.empty() ? nil_ : branch_path.top();
+        if (branch_node == nil_ || (base_node != nil_ && KeyOf(base_node) < KeyOf(branch_node)))
+        {
+            differences.push_back({base_node, nil_});// deleted in branch
+            branch_node = nil_;
+        }
+        else if (base_node == nil_ || KeyOf(branch_node) < KeyOf(base_node))
+        {
+            differences.push_back({nil_, branch_node});// inserted in branch
+            base_node = nil_;
+        }
+        else if (base_node != branch_node && !(MappedOf(base_node) == MappedOf(branch_node)))
+        {
+            differences.push_back({base_node, branch_node});// assigned in branch
+        }
+        if (base_node != nil_)
+        {
+            base_path.pop();
+            base_pending = base_node->right;
+        }
+        if (branch_node != nil_)
+        {
+            branch_path.pop();
+            branch_pending = branch_node->right;
+        }
+    }
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+template <class Resolver>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::Merge
+    (Version* base, Version* ours, Version* theirs, Resolver resolver)
+{
+    std::vector<Difference> our_differences, their_differences;
+    typename std::vector<Difference>::iterator our_it, their_it;
+    Version* new_version;
+    Node *base_node, *our_node, *their_node;
+    static_assert(kMulti == false, "Merge matches elements by key, so it needs unique keys");
+    MakeResident(base);
+    MakeResident(ours);
+    MakeResident(theirs);
+    // start from ours and replay the changes of theirs
+    new_version = CreateVersion(ours);
+    if (ours->root_ == base->root_)
+    {
+        // nothing changed on ours; take theirs as a whole
+        --new_version->root_->use_count;
+        new_version->root_ = theirs->root_;
+        ++new_version->root_->use_count;
+        new_version->leftmost_ = theirs->leftmost_;
+        new_version->rightmost_ = theirs->rightmost_;
+        return new_version;
+    }
+    DiffSubtrees(base->root_, ours->root_, our_differences);
+    DiffSubtrees(base->root_, theirs->root_, their_differences);
+    our_it = our_differences.begin();
+    for (their_it = their_differences.begin(); their_it != their_differences.end(); ++their_it)
+    {
+        base_node = their_it->base;
+        their_node = their_it->branch;
+        const Key& key = their_node != nil_ ? KeyOf(their_node) : KeyOf(base_node);
+        while (our_it != our_differences.end() && 
+            KeyOf((our_it->base != nil_ ? our_it->base : our_it->branch)) < key)
+            ++our_it;
+        if (our_it != our_differences.end() && 
+            KeyOf((our_it->base != nil_ ? our_it->base : our_it->branch)) == key)
+        {
+            // changed on both branches
+            our_node = our_it->branch;
+            if (our_node == nil_ && their_node == nil_) continue;
+            if (our_node != nil_ && their_node != nil_ && MappedOf(our_node) == MappedOf(their_node)) 
+                continue;
+            std::pair<bool, T> resolved = resolver(key,
+                base_node == nil_ ? nullptr : &MappedOf(base_node),
+                our_node == nil_ ? nullptr : &MappedOf(our_node),
+                their_node == nil_ ? nullptr : &MappedOf(their_node));
+            MergeKey(&(new_version->root_), key, resolved.first ? &resolved.second : nullptr);
+        }
+        else
+        {
+            MergeKey(&(new_version->root_), key, their_node == nil_ ? nullptr : &MappedOf(their_node));
+        }
+    }
+    UpdateAggregates(new_version->root_);
+    UpdateExtremes(new_version, nullptr, nullptr);
+    return new_version;
+}
+
+// give key the value *merged in the tree at *root_ptr, or delete it if merged is nullptr
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::MergeKey(Node** root_ptr, const Key& key, const T* merged)
+{
+    if (merged == nullptr)
+        DeleteNode(root_ptr, key);
+    else
+        Traits::AssignMapped(InsertNode(root_ptr, Traits::MakeValue(key, *merged)).first->value,
+            Traits::MakeValue(key, *merged));
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+FrozenVersion<Key, T> PersistentRedBlackTree<Key, T, Monoid, kMulti>::Freeze(Version* version)
+{
+    std::vector<ValueType> values;
+    NodePath path;
+    Node* now;
+    static_assert(std::is_same<T, SetMapped>::value == false, "FrozenVersion stores key-value pairs");
+    MakeResident(version);
+    // in-order walk
+    now = version->root_;
+    while (now != nil_ || path.empty() == false)
+    {
+        while (now != nil_)
+        {
+            path.push(now);
+            now = now->left;
+        }
+        now = path.top();
+        path.pop();
+        values.push_back(now->value);
+        now = now->right;
+    }
+    return FrozenVersion<Key, T>(std::move(values));
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+template <class Sink>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::ExportColumns(Version* version, Sink sink, std::size_t chunk_size)
+{
+    // arrays rather than vectors, whose data() std::vector<bool> lacks
+    std::unique_ptr<Key[]> keys;
+    std::unique_ptr<T[]> values;
+    std::size_t filled;
+    NodePath path;
+    Node* now;
+    if (chunk_size == 0) throw std::invalid_argument("the chunk size must be positive");
+    MakeResident(version);
+    keys.reset(new Key[chunk_size]);
+    values.reset(new T[chunk_size]);
+    filled = 0;
+    // in-order walk, as in Freeze
+    now = version->root_;
+    while (now != nil_ || path.empty() == false)
+    {
+        while (now != nil_)
+        {
+            path.push(now);
+            now = now->left;
+        }
+        now = path.top();
+        path.pop();
+        keys[filled] = KeyOf(now);
+        values[filled] = MappedOf(now);
+        if (++filled == chunk_size)
+        {
+            sink(static_cast<const Key*>(keys.get()), static_cast<const T*>(values.get()), filled);
+            filled = 0;
+        }
+        now = now->right;
+    }
+    if (filled > 0)
+        sink(static_cast<const Key*>(keys.get()), static_cast<const T*>(values.get()), filled);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::ExportColumns
+    (Version* version, std::vector<Key>& keys, std::vector<T>& values)
+{
+    ExportColumns(version, [&keys, &values](const Key* key_chunk, const T* value_chunk, std::size_t size) {
+        keys.insert(keys.end(), key_chunk, key_chunk + size);
+        values.insert(values.end(), value_chunk, value_chunk + size);
+    });
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::Deduplicate(const std::vector<Version*>& versions)
+{
+    CanonicalNodeSet canonical_nodes;
+    std::unordered_map<Node*, Node*> canonical_of;
+    Version* version;
+    std::size_t i;
+    for (i = 0; i < versions.size(); ++i) MakeResident(versions[i]);
+    for (i = 0; i < versions.size(); ++i)
+        ReplaceReference(&(versions[i]->root_), CanonicalSubtree(versions[i]->root_, canonical_nodes, canonical_of));
+    // any version may share a node whose children were replaced
+    for (version = version_nil_->next_; version != version_nil_; version = version->next_)
+        if (version->root_ != nullptr) UpdateExtremes(version, nullptr, nullptr);
+    finger_version_ = nullptr;
+    finger_.clear();
+}
+
+// the first node met of those equal to subtree_root; the children are made
+// canonical first, in place, which no reader can tell apart
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::CanonicalSubtree
+    (Node* subtree_root, CanonicalNodeSet& canonical_nodes, std::unordered_map<Node*, Node*>& canonical_of)
+{
+    typename std::unordered_map<Node*, Node*>::iterator it;
+    Node* canonical;
+    if (subtree_root == nil_) return nil_;
+    it = canonical_of.find(subtree_root);
+    if (it != canonical_of.end()) return it->second;
+    ReplaceReference(&(subtree_root->left), CanonicalSubtree(subtree_root->left, canonical_nodes, canonical_of));
+    ReplaceReference(&(subtree_root->right), CanonicalSubtree(subtree_root->right, canonical_nodes, canonical_of));
+    canonical = *canonical_nodes.insert(subtree_root).first;
+    canonical_of.emplace(subtree_root, canonical);
+    return canonical;
+}
+
+// point *slot at subtree_root, a subtree equal to the one it points at,
+// and drop the reference to the old one
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::ReplaceReference(Node** slot, Node* subtree_root)
+{
+    if (*slot == subtree_root) return;
+    ++subtree_root->use_count;
+    ReleaseSubtree(*slot);
+    *slot = subtree_root;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::FreeNode(Node* node)
+{
+    typename std::map<std::uintptr_t, NodeArena>::iterator it;
+    typename std::unordered_map<Node*, StoredNodeId>::iterator stored_it;
+    std::uintptr_t address;
+    if (stored_id_of_.empty() == false)
+    {
+        stored_it = stored_id_of_.find(node);
+        if (stored_it != stored_id_of_.end())
+        {
+            // the record stays while a stored version uses it
+            resident_of_.erase(stored_it->second);
+            stored_id_of_.erase(stored_it);
+        }
+    }
+    if (arenas_.empty() == false)
+    {
+        address = reinterpret_cast<std::uintptr_t>(node);
+        it = arenas_.upper_bound(address);
+        if (it != arenas_.begin() && address < (--it)->first + it->second.size * sizeof(Node))
+        {
+            // moved by Compact
+            node->~Node();
+            if (--it->second.live == 0)
+            {
+                ::operator delete(reinterpret_cast<void*>(it->first));
+                arenas_.erase(it);
+            }
+            return;
+        }
+    }
+    delete node;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::Compact(Version* version)
+{
+    std::vector<Node*> order;
+    std::unordered_map<Node*, Node*> destination;
+    typename std::unordered_map<Node*, Node*>::const_iterator it;
+    Node* block;
+    std::size_t i;
+    MakeResident(version);
+    version->reads_.store(0, std::memory_order_relaxed);
+    // a node with use_count 0 below the root has a single parent, so a path of such
+    // nodes from the root is reached from this version alone
+    VanEmdeBoasOrder(version->root_, SubtreeHeight(version->root_), order);
+    if (order.empty()) return;
+    block = static_cast<Node*>(::operator new(order.size() * sizeof(Node)));
+    arenas_.emplace(reinterpret_cast<std::uintptr_t>(block), NodeArena{order.size(), order.size()});
+    for (i = 0; i < order.size(); ++i) destination.emplace(order[i], block + i);
+    RelocateSubtree(&(version->root_), destination);
+    // so the extremes of no other version can be among the moved nodes
+    it = destination.find(version->leftmost_);
+    if (it != destination.end()) version->leftmost_ = it->second;
+    it = destination.find(version->rightmost_);
+    if (it != destination.end()) version->rightmost_ = it->second;
+    finger_version_ = nullptr;
+    finger_.clear();
+}
+
+// move the nodes of the subtree *slot to their destinations, children first;
+// shared nodes, and everything below them, stay where they are
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::RelocateSubtree
+    (Node** slot, const std::unordered_map<Node*, Node*>& destination)
+{
+    typename std::unordered_map<Node*, StoredNodeId>::iterator stored_it;
+    StoredNodeId stored_id;
+    Node *node, *moved;
+    node = *slot;
+    if (node == nil_ || node->use_count > 0) return;
+    RelocateSubtree(&(node->left), destination);
+    RelocateSubtree(&(node->right), destination);
+    moved = new (destination.at(node)) Node(*node);
+    if (stored_id_of_.empty() == false)
+    {
+        stored_it = stored_id_of_.find(node);
+        if (stored_it != stored_id_of_.end())
+        {
+            // the record now belongs to the moved node, so FreeNode leaves it be
+            stored_id = stored_it->second;
+            stored_id_of_.erase(stored_it);
+            stored_id_of_.emplace(moved, stored_id);
+            resident_of_[stored_id] = moved;
+        }
+    }
+    *slot = moved;
+    FreeNode(node);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+int PersistentRedBlackTree<Key, T, Monoid, kMulti>::SubtreeHeight(Node* subtree_root)
+{
+    if (subtree_root == nil_ || subtree_root->use_count > 0) return 0;
+    return 1 + std::max(SubtreeHeight(subtree_root->left), SubtreeHeight(subtree_root->right));
+}
+
+// the top half of the levels first, then each subtree hanging below them, recursively;
+// a search then touches O(log_B n) blocks of B nodes for any B
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::VanEmdeBoasOrder
+    (Node* subtree_root, int levels, std::vector<Node*>& order)
+{
+    std::vector<Node*> bottom_roots;
+    std::size_t i;
+    int top_levels;
+    if (subtree_root == nil_ || subtree_root->use_count > 0 || levels == 0) return;
+    if (levels == 1)
+    {
+        order.push_back(subtree_root);
+        return;
+    }
+    top_levels = levels / 2;
+    VanEmdeBoasOrder(subtree_root, top_levels, order);
+    CollectLevel(subtree_root, top_levels, bottom_roots);
+    for (i = 0; i < bottom_roots.size(); ++i) VanEmdeBoasOrder(bottom_roots[i], levels - top_levels, order);
+}
+
+// the nodes depth levels below subtree_root, from left to right
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::CollectLevel
+    (Node* subtree_root, int depth, std::vector<Node*>& level)
+{
+    if (subtree_root == nil_ || subtree_root->use_count > 0) return;
+    if (depth == 0)
+    {
+        level.push_back(subtree_root);
+        return;
+    }
+    CollectLevel(subtree_root->left, depth - 1, level);
+    CollectLevel(subtree_root->right, depth - 1, level);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::SetCompactionThreshold(std::uint32_t read_threshold, Clock::duration min_age)
+{
+    compaction_read_threshold_ = read_threshold;
+    compaction_min_age_ = min_age;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::size_t PersistentRedBlackTree<Key, T, Monoid, kMulti>::CompactHotVersions()
+{
+    Version* version;
+    TimePoint now;
+    std::size_t compacted_num;
+    compacted_num = 0;
+    if (compaction_read_threshold_ == 0) return compacted_num;
+    now = Clock::now();
+    for (version = version_nil_->next_; version != version_nil_; version = version->next_)
+    {
+        if (version->reads_.load(std::memory_order_relaxed) >= compaction_read_threshold_ &&
+            now - version->timestamp_ >= compaction_min_age_)
+        {
+            Compact(version);
+            ++compacted_num;
+        }
+    }
+    return compacted_num;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::SetPageStore(BufferPool* page_store)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+        "PageOut copies keys and values bytewise");
+    if (page_store_ != nullptr) throw std::logic_error("the tree already has a page store");
+    if (page_store->page_size() < sizeof(StoredNode)) throw std::invalid_argument("a page must hold a node");
+    page_store_ = page_store;
+    stored_per_page_ = page_store->page_size() / sizeof(StoredNode);
+    stored_use_counts_.assign(1, 0);// kNilStoredNodeId
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::PageOut(Version* version)
+{
+    StoredNodeId stored_root;
+    if (page_store_ == nullptr) throw std::logic_error("the tree has no page store");
+    if (version->root_ == nullptr) return;
+    if (version == finger_version_)
+    {
+        finger_version_ = nullptr;
+        finger_.clear();
+    }
+    // a version paged in and out again finds its records still there
+    stored_root = StoreSubtree(version->root_);
+    ReleaseStored(version->stored_root_);
+    version->stored_root_ = stored_root;
+    ReleaseSubtree(version->root_);
+    version->root_ = version->leftmost_ = version->rightmost_ = nullptr;
+    version->reads_.store(0, std::memory_order_relaxed);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::PageIn(Version* version)
+{
+    if (version->root_ != nullptr) return;
+    version->root_ = LoadSubtree(version->stored_root_);
+    // the nodes read have use_count 0, those found resident are shared
+    UpdateAggregates(version->root_);
+    UpdateExtremes(version, nullptr, nullptr);
+}
+
+// the record of subtree_root, written after those of its children unless already
+// stored; counts one more reference to it
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::StoredNodeId PersistentRedBlackTree<Key, T, Monoid, kMulti>::StoreSubtree
+    (Node* subtree_root)
+{
+    typename std::unordered_map<Node*, StoredNodeId>::iterator it;
+    StoredNode stored;
+    StoredNodeId id;
+    if (subtree_root == nil_) return kNilStoredNodeId;
+    it = stored_id_of_.find(subtree_root);
+    if (it != stored_id_of_.end())
+    {
+        // so is its whole subtree
+        ++stored_use_counts_[it->second];
+        return it->second;
+    }
+    std::memset(&stored, 0, sizeof(StoredNode));
+    stored.left = StoreSubtree(subtree_root->left);
+    stored.right = StoreSubtree(subtree_root->right);
+    stored.sequence = subtree_root->Sequence();
+    stored.color = subtree_root->color;
+    std::memcpy(stored.key, &KeyOf(subtree_root), sizeof(Key));
+    std::memcpy(stored.mapped, &MappedOf(subtree_root), sizeof(T));
+    id = AllocateStoredId();
+    stored_use_counts_[id] = 1;
+    WriteStored(id, stored);
+    stored_id_of_.emplace(subtree_root, id);
+    resident_of_.emplace(id, subtree_root);
+    return id;
+}
+
+// the node of record id, with one more reference; read from the page store
+// unless a resident version still uses it
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::LoadSubtree
+    (StoredNodeId id)
+{
+    typename std::unordered_map<StoredNodeId, Node*>::iterator it;
+    StoredNode stored;
+    Node* node;
+    if (id == kNilStoredNodeId) return nil_;
+    it = resident_of_.find(id);
+    if (it != resident_of_.end())
+    {
+        ++it->second->use_count;
+        return it->second;
+    }
+    ReadStored(id, stored);
+    node = new Node(Traits::MakeValue(*reinterpret_cast<const Key*>(stored.key),
+        *reinterpret_cast<const T*>(stored.mapped)));
+    node->color = stored.color == Node::RED ? Node::RED : Node::BLACK;
+    node->RestoreSequence(stored.sequence);
+    node->left = LoadSubtree(stored.left);
+    node->right = LoadSubtree(stored.right);
+    stored_id_of_.emplace(node, id);
+    resident_of_.emplace(id, node);
+    return node;
+}
+
+// drop one reference to record id, freeing the records no version uses
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::ReleaseStored(StoredNodeId id)
+{
+    typename std::unordered_map<StoredNodeId, Node*>::iterator it;
+    StoredNode stored;
+    if (id == kNilStoredNodeId || --stored_use_counts_[id] > 0) return;
+    ReadStored(id, stored);
+    it = resident_of_.find(id);
+    if (it != resident_of_.end())
+    {
+        // the node stays for the resident versions using it
+        stored_id_of_.erase(it->second);
+        resident_of_.erase(it);
+    }
+    free_stored_ids_.push_back(id);
+    ReleaseStored(stored.left);
+    ReleaseStored(stored.right);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::StoredNodeId PersistentRedBlackTree<Key, T, Monoid, kMulti>::AllocateStoredId()
+{
+    StoredNodeId id;
+    if (free_stored_ids_.empty() == false)
+    {
+        id = free_stored_ids_.back();
+        free_stored_ids_.pop_back();
+        return id;
+    }
+    id = stored_use_counts_.size();
+    stored_use_counts_.push_back(0);
+    if (id / stored_per_page_ == stored_pages_.size()) stored_pages_.push_back(page_store_->Allocate());
+    return id;
+}
+
+// the page is pinned only while the record is copied
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::ReadStored(StoredNodeId id, StoredNode& stored)
+{
+    PageId page;
+    page = stored_pages_[id / stored_per_page_];
+    std::memcpy(&stored, page_store_->Pin(page) + id % stored_per_page_ * sizeof(StoredNode), sizeof(StoredNode));
+    page_store_->Unpin(page, false);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::WriteStored(StoredNodeId id, const StoredNode& stored)
+{
+    PageId page;
+    page = stored_pages_[id / stored_per_page_];
+    std::memcpy(page_store_->Pin(page) + id % stored_per_page_ * sizeof(StoredNode), &stored, sizeof(StoredNode));
+    page_store_->Unpin(page, true);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::Prefetch(const void* address)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(address);
+#endif
+}
+
+// splits keys into kDescentGroupSize runs searched in lock-step, one level
+// per round, so that their cache misses overlap; if keys are sorted, each
+// search restarts below the last left turn of the previous one that still
+// bounds the key, instead of at the root
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::FindMany
+    (const std::vector<Key>& keys, Version* version, std::vector<ConstIterator>& out)
+{
+    Descent descents[kDescentGroupSize];
+    std::size_t run_size;
+    Node* now;
+    bool is_sorted;
+    int active, i;
+    static_assert(kMulti == false, "FindMany stops at the first equal key, so it needs unique keys");
+    MakeResident(version);
+    out.resize(keys.size());
+    is_sorted = std::is_sorted(keys.begin(), keys.end());
+    run_size = (keys.size() + kDescentGroupSize - 1) / kDescentGroupSize;
+    active = 0;
+    for (i = 0; i < kDescentGroupSize; ++i)
+    {
+        descents[i].index = std::min(keys.size(), i * run_size);
+        descents[i].end = std::min(keys.size(), (i + 1) * run_size);
+        descents[i].now = version->root_;
+        if (descents[i].index < descents[i].end) ++active;
+    }
+    while (active > 0)
+    {
+        for (i = 0; i < kDescentGroupSize; ++i)
+        {
+            Descent& descent = descents[i];
+            if (descent.index == descent.end) continue;
+            const Key& key = keys[descent.index];
+            now = descent.now;
+            if (now == nil_ || KeyOf(now) == key)
+            {
+                out[descent.index] = ConstIterator(now, this, version);
+                if (++descent.index == descent.end)
+                {
+                    --active;
+                    continue;
+                }
+                if (is_sorted)
+                {
+                    while (descent.left_turns.empty() == false && 
+                        !(keys[descent.index] < KeyOf(descent.left_turns.back())))
+                        descent.left_turns.pop_back();
+                    now = descent.left_turns.empty() ? version->root_ : descent.left_turns.back()->left;
+                }
+                else
+                {
+                    now = version->root_;
+                }
+            }
+            else if (key < KeyOf(now))
+            {
+                if (is_sorted) descent.left_turns.push_back(now);
+                now = now->left;
+            }
+            else
+            {
+                now = now->right;
+            }
+            descent.now = now;
+            Prefetch(now);
+        }
+    }
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::AtMany(const std::vector<Key>& keys, Version* version, std::vector<T>& out)
+{
+    std::vector<ConstIterator> found;
+    typename std::vector<ConstIterator>::iterator it;
+    FindMany(keys, version, found);
+    out.clear();
+    out.reserve(found.size());
+    for (it = found.begin(); it != found.end(); ++it)
+    {
+        if (*it == CEnd()) throw std::out_of_range("the container does not have an element with the specified key");
+        out.push_back(MappedOf(it->node_));
+    }
+}
+
+// recompute the aggregates of the nodes used only by the version being built,
+// i.e. those reachable from subtree_root through nodes with use_count == 0
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::UpdateAggregates(Node* subtree_root)
+{
+    UpdateAggregates(subtree_root, std::integral_constant<bool, !std::is_same<Monoid, NoAggregate>::value>());
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::UpdateAggregates(Node*, std::false_type)
+{
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::UpdateAggregates(Node* subtree_root, std::true_type)
+{
+    if (subtree_root == nil_ || subtree_root->use_count > 0) return;
+    UpdateAggregates(subtree_root->left, std::true_type());
+    UpdateAggregates(subtree_root->right, std::true_type());
+    subtree_root->aggregate = Monoid::Combine(Monoid::Combine(subtree_root->left->aggregate,
+        Monoid::Lift(KeyOf(subtree_root), MappedOf(subtree_root))), subtree_root->right->aggregate);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::AggregateType PersistentRedBlackTree<Key, T, Monoid, kMulti>::RangeAggregate
+    (const Key& lower, const Key& upper, Version* version)
+{
+    Node *split, *now;
+    AggregateType left_aggregate, right_aggregate;
+    MakeResident(version);
+    // find the highest node in the range
+    split = version->root_;
+    while (split != nil_)
+    {
+        if (KeyOf(split) < lower)
+            split = split->right;
+        else if (KeyOf(split) < upper)
+            break;
+        else
+            split = split->left;
+    }
+    if (split == nil_) return Monoid::Identity();
+    // keys >= lower in the left subtree, accumulated from the right
+    left_aggregate = Monoid::Identity();
+    for (now = split->left; now != nil_; )
+    {
+        if (KeyOf(now) < lower)
+        {
+            now = now->right;
+        }
+        else
+        {
+            left_aggregate = Monoid::Combine(Monoid::Combine(Monoid::Lift(KeyOf(now), MappedOf(now)),
+                now->right->aggregate), left_aggregate);
+            now = now->left;
+        }
+    }
+    // keys < upper in the right subtree, accumulated from the left
+    right_aggregate = Monoid::Identity();
+    for (now = split->right; now != nil_; )
+    {
+        if (KeyOf(now) < upper)
+        {
+            right_aggregate = Monoid::Combine(right_aggregate, Monoid::Combine(now->left->aggregate,
+                Monoid::Lift(KeyOf(now), MappedOf(now))));
+            now = now->right;
+        }
+        else
+        {
+            now = now->left;
+        }
+    }
+    return Monoid::Combine(Monoid::Combine(left_aggregate, Monoid::Lift(KeyOf(split), MappedOf(split))),
+        right_aggregate);
+}
+
+// number of black nodes on a path from subtree_root down to nil_
+template <class Key, class T, class Monoid, bool kMulti>
+int PersistentRedBlackTree<Key, T, Monoid, kMulti>::BlackHeight(Node* subtree_root)
+{
+    int height;
+    height = 0;
+    for (; subtree_root != nil_; subtree_root = subtree_root->left)
+        if (subtree_root->color == Node::BLACK) ++height;
+    return height;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::PaintRootBlack(Node** root_ptr)
+{
+    if ((*root_ptr)->color == Node::BLACK) return;
+    CreateCopyAndPlant(root_ptr);
+    (*root_ptr)->color = Node::BLACK;
+}
+
+// join left, middle and right (keys in this order) into one tree and return its root;
+// left and right are references handed over to the result, middle is a node used
+// only by the tree being built, and the heights are black heights (see BlackHeight);
+// takes O(|left_height - right_height| + 1)
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::JoinSubtrees
+    (Node* left, int left_height, Node* middle, Node* right, int right_height, int& height)
+{
+    Node *root, **now_ptr, **parent_ptr, **grandparent_ptr;
+    SlotPath path;
+    bool is_left_higher;
+    int now_height;
+    if (left->color == Node::RED)
+    {
+        PaintRootBlack(&left);
+        ++left_height;
+    }
+    if (right->color == Node::RED)
+    {
+        PaintRootBlack(&right);
+        ++right_height;
+    }
+    middle->color = Node::RED;
+    if (left_height == right_height)
+    {
+        middle->left = left;
+        middle->right = right;
+        height = left_height;
+        return middle;
+    }
+    // go down the facing spine of the higher tree to a black node as high as the lower tree
+    is_left_higher = left_height > right_height;
+    root = is_left_higher ? left : right;
+    now_ptr = &root;
+    now_height = is_left_higher ? left_height : right_height;
+    height = now_height;
+    while ((*now_ptr)->color == Node::RED || now_height != (is_left_higher ? right_height : left_height))
+    {
+        if ((*now_ptr)->color == Node::BLACK) --now_height;
+        CreateCopyAndPlant(now_ptr);
+        path.push(now_ptr);
+        now_ptr = is_left_higher ? &((*now_ptr)->right) : &((*now_ptr)->left);
+    }
+    middle->left = is_left_higher ? *now_ptr : left;
+    middle->right = is_left_higher ? right : *now_ptr;
+    *now_ptr = middle;
+    // the red middle may have a red parent; its grandparent is black, so
+    // paint the lower red node black and rotate the red parent up
+    while (path.empty() == false)
+    {
+        parent_ptr = path.top();
+        path.pop();
+        if ((*parent_ptr)->color == Node::BLACK) break;
+        grandparent_ptr = path.top();// a red node is never the root here
+        path.pop();
+        (*now_ptr)->color = Node::BLACK;
+        if (is_left_higher)
+            LeftRotate(grandparent_ptr);
+        else
+            RightRotate(grandparent_ptr);
+        now_ptr = grandparent_ptr;
+    }
+    return root;
+}
+
+// join-based split of the tree referenced by root (black height height) into
+// the keys less than key and the others: every node on the search path is
+// joined back onto either side as the descent unwinds; the heights telescope,
+// so the total cost is O(lg n) and only the search path is copied
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::SplitSubtree(Node* root, int height, const Key& key,
+    Node*& left, int& left_height, Node*& right, int& right_height)
+{
+    Node* now;
+    std::vector<std::pair<Node*, int>> path;// node owned by the result, black height of its children
+    typename std::vector<std::pair<Node*, int>>::reverse_iterator it;
+    now = root;
+    while (now != nil_)
+    {
+        CreateCopyAndPlant(&now);
+        if (now->color == Node::BLACK) --height;
+        path.push_back(std::make_pair(now, height));
+        now = KeyOf(now) < key ? now->right : now->left;
+    }
+    left = right = nil_;
+    left_height = right_height = 0;
+    for (it = path.rbegin(); it != path.rend(); ++it)
+    {
+        now = it->first;
+        if (KeyOf(now) < key)
+            left = JoinSubtrees(now->left, it->second, now, left, left_height, left_height);
+        else
+            right = JoinSubtrees(right, right_height, now, now->right, it->second, right_height);
+    }
+}
+
+// join two references whose keys are in order; the minimum of right becomes the middle node
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Node* PersistentRedBlackTree<Key, T, Monoid, kMulti>::ConcatenateSubtrees
+    (Node* left, int left_height, Node* right)
+{
+    Node* middle;
+    int height;
+    if (right == nil_) return left;
+    middle = new Node(*TreeMinimum(right));
+    middle->use_count = 0;
+    DeleteNode(&right, KeyOf(middle));
+    return JoinSubtrees(left, left_height, middle, right, BlackHeight(right), height);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::pair<typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*, typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version*>
+    PersistentRedBlackTree<Key, T, Monoid, kMulti>::Split(Version* version, const Key& key)
+{
+    Version *left_version, *right_version;
+    int left_height, right_height;
+    MakeResident(version);
+    left_version = CreateVersion(version);
+    right_version = CreateVersion(version);
+    --right_version->root_->use_count;// its root comes from the split of left_version's reference
+    SplitSubtree(left_version->root_, BlackHeight(left_version->root_), key,
+        left_version->root_, left_height, right_version->root_, right_height);
+    PaintRootBlack(&(left_version->root_));
+    PaintRootBlack(&(right_version->root_));
+    UpdateAggregates(left_version->root_);
+    UpdateAggregates(right_version->root_);
+    UpdateExtremes(left_version, nullptr, nullptr);
+    UpdateExtremes(right_version, nullptr, nullptr);
+    return std::make_pair(left_version, right_version);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::Join
+    (Version* left_version, Version* right_version)
+{
+    Version* new_version;
+    MakeResident(left_version);
+    MakeResident(right_version);
+    if (left_version->root_ != nil_ && right_version->root_ != nil_ &&
+        !NodeLess(left_version->rightmost_, right_version->leftmost_))
+        throw std::invalid_argument("the keys of the left version must be less than the keys of the right version");
+    new_version = CreateVersion(left_version);
+    ++right_version->root_->use_count;
+    new_version->root_ = ConcatenateSubtrees(new_version->root_, BlackHeight(new_version->root_), right_version->root_);
+    PaintRootBlack(&(new_version->root_));
+    UpdateAggregates(new_version->root_);
+    UpdateExtremes(new_version, nullptr, nullptr);
+    return new_version;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::DeleteRange
+    (const Key& lower, const Key& upper)
+{
+    return DeleteRange(lower, upper, version_nil_->next_);
+}
+
+// cut [lower, upper) out with two splits and join the outer parts; the cut
+// part is shared with dependent_version except for O(lg n) copied nodes,
+// so releasing it does not depend on the size of the range either
+template <class Key, class T, class Monoid, bool kMulti>
+typename PersistentRedBlackTree<Key, T, Monoid, kMulti>::Version* PersistentRedBlackTree<Key, T, Monoid, kMulti>::DeleteRange
+    (const Key& lower, const Key& upper, Version* dependent_version)
+{
+    Version* new_version;
+    Node *left, *middle, *right;
+    int left_height, middle_height, right_height;
+    MakeResident(dependent_version);
+    new_version = CreateVersion(dependent_version);
+    if (lower < upper)
+    {
+        SplitSubtree(new_version->root_, BlackHeight(new_version->root_), lower,
+            left, left_height, right, right_height);
+        SplitSubtree(right, right_height, upper, middle, middle_height, right, right_height);
+        ReleaseSubtree(middle);
+        new_version->root_ = ConcatenateSubtrees(left, left_height, right);
+        PaintRootBlack(&(new_version->root_));
+    }
+    UpdateAggregates(new_version->root_);
+    UpdateExtremes(new_version, nullptr, nullptr);
+    return new_version;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::size_t PersistentRedBlackTree<Key, T, Monoid, kMulti>::HistoryMemoSlot(const Node* node)
+{
+    std::uintptr_t address;
+    address = reinterpret_cast<std::uintptr_t>(node);
+    return ((address >> 4) ^ (address >> 12)) & (kHistoryMemoSize - 1);
+}
+
+// nodes never change once their version is built, so a search that reaches a
+// node of the previous search path ends exactly like the previous search did;
+// the path is kept from the result up to the root, so that only the nodes
+// above the shared node are replaced, and a small direct-mapped memo finds
+// shared nodes by pointer without leaving the L1 cache; the work per version
+// is the number of nodes not shared with the previous search path
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::HistoryOfRun(const Key& key, const std::vector<Version*>& versions,
+    std::size_t begin, std::size_t end, std::vector<ConstIterator>& out)
+{
+    std::pair<const Node*, std::size_t> memo[kHistoryMemoSize];// node -> its index in path; may be stale
+    std::vector<Node*> path, prefix;
+    std::size_t i, index;
+    Node* now;
+    static_assert(kMulti == false, "HistoryOf stops at the first equal key, so it needs unique keys");
+    for (index = 0; index < kHistoryMemoSize; ++index) memo[index] = std::make_pair(nullptr, 0);
+    for (i = begin; i < end; ++i)
+    {
+        // the searches depend on each other through the path, so fetch the upcoming roots early
+        if (i + 2 * kHistoryLookahead < end) Prefetch(versions[i + 2 * kHistoryLookahead]);
+        if (i + kHistoryLookahead < end) Prefetch(versions[i + kHistoryLookahead]->root_);
+        prefix.clear();
+        now = versions[i]->root_;
+        while (true)
+        {
+            index = memo[HistoryMemoSlot(now)].second;
+            if (memo[HistoryMemoSlot(now)].first == now && index < path.size() && path[index] == now)
+            {
+                path.resize(index + 1);
+                break;
+            }
+            prefix.push_back(now);
+            if (now == nil_ || KeyOf(now) == key)
+            {
+                path.clear();
+                break;
+            }
+            now = key < KeyOf(now) ? now->left : now->right;
+        }
+        while (prefix.empty() == false)
+        {
+            memo[HistoryMemoSlot(prefix.back())] = std::make_pair(prefix.back(), path.size());
+            path.push_back(prefix.back());
+            prefix.pop_back();
+        }
+        out[i] = ConstIterator(path.front(), this, versions[i]);
+    }
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::HistoryOf
+    (const Key& key, const std::vector<Version*>& versions, std::vector<ConstIterator>& out)
+{
+    std::size_t i;
+    for (i = 0; i < versions.size(); ++i) MakeResident(versions[i]);
+    out.resize(versions.size());
+    HistoryOfRun(key, versions, 0, versions.size(), out);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void PersistentRedBlackTree<Key, T, Monoid, kMulti>::HistoryOf
+    (const Key& key, const std::vector<Version*>& versions, std::vector<ConstIterator>& out, unsigned thread_num)
+{
+    std::vector<std::thread> threads;
+    std::size_t run_size, begin;
+    // paging in is not thread-safe, so it happens first
+    for (begin = 0; begin < versions.size(); ++begin) MakeResident(versions[begin]);
+    out.resize(versions.size());
+    if (thread_num < 1) thread_num = 1;
+    run_size = (versions.size() + thread_num - 1) / thread_num;
+    // consecutive versions share the most, so each thread takes a run of them
+    for (begin = 0; begin < versions.size(); begin += run_size)
+        threads.emplace_back(&PersistentRedBlackTree::HistoryOfRun, this, std::cref(key), std::cref(versions),
+            begin, std::min(versions.size(), begin + run_size), std::ref(out));
+    for (std::thread& thread : threads) thread.join();
+}
+
 #endif
@@ -0,0 +1,118 @@
+#include "persistent_red_black_tree_test.hpp"
+
+#ifndef CATCH_CONFIG_MAIN
+#  define CATCH_CONFIG_MAIN
+#endif
+#include <catch/catch.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+
+typedef PersistentRedBlackTreeTest<int, char> Tree;
+typedef Tree::Version* VersionPtr;
+
+// allocations made by the whole program, to count those of single updates; these
+// replacements cover the whole executable, hence a test binary of its own
+static std::atomic<std::size_t> allocation_num(0);
+
+// GCC pairs the replaced operators with std::malloc and std::free it cannot see through
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(std::size_t size)
+{
+    void* memory;
+    ++allocation_num;
+    memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == nullptr) throw std::bad_alloc();
+    return memory;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    ++allocation_num;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return operator new(size, std::nothrow); }
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+void operator delete[](void* memory) noexcept { std::free(memory); }
+void operator delete[](void* memory, std::size_t) noexcept { std::free(memory); }
+#pragma GCC diagnostic pop
+
+TEST_CASE("allocations per update", "")
+{
+    Tree tree;
+    std::mt19937 rng(38);
+    std::size_t allocations, extra_allocations, op_num;
+    std::size_t op_allocations[3], op_extra_allocations[3];// insert, delete, pop
+    std::pair<VersionPtr, bool> delete_result;
+    VersionPtr version;
+    int key;
+
+    for (int i = 0; i < 5000; ++i) tree.Insert({int(rng() % 100000), 'a'});
+    // an update allocates the nodes it copies or creates, which are the nodes
+    // only its version uses; anything else comes from the amortized growth of
+    // the arrays indexed by version id, and a chunk of Version records per 64 versions
+    extra_allocations = 0;
+    op_num = 3000;
+    for (int i = 0; i < 3; ++i) op_allocations[i] = op_extra_allocations[i] = 0;
+    for (std::size_t i = 0; i < op_num; ++i)
+    {
+        key = rng() % 100000;
+        allocations = allocation_num;
+        switch (i % 3)
+        {
+        case 0:
+            version = tree.Insert({key, 'b'}).first.version();
+            break;
+        case 1:
+            version = tree.Delete(key).first;
+            break;
+        default:
+            version = tree.PopMin().first;
+            break;
+        }
+        allocations = allocation_num - allocations;
+        REQUIRE(allocations >= tree.CountOwnedNodes(version->root_));
+        extra_allocations += allocations - tree.CountOwnedNodes(version->root_);
+        op_allocations[i % 3] += allocations;
+        op_extra_allocations[i % 3] += allocations - tree.CountOwnedNodes(version->root_);
+    }
+    std::cout << "allocations per insert: " << double(op_allocations[0]) / (op_num / 3)
+        << " (" << double(op_extra_allocations[0]) / (op_num / 3) << " besides its nodes)" << std::endl;
+    std::cout << "allocations per delete: " << double(op_allocations[1]) / (op_num / 3)
+        << " (" << double(op_extra_allocations[1]) / (op_num / 3) << " besides its nodes)" << std::endl;
+    std::cout << "allocations per pop: " << double(op_allocations[2]) / (op_num / 3)
+        << " (" << double(op_extra_allocations[2]) / (op_num / 3) << " besides its nodes)" << std::endl;
+    REQUIRE(extra_allocations * 20 < op_num);
+    REQUIRE(tree.CheckTreeValidAllVersion());
+
+    // removal frees nodes and recycles the Version record, allocating nothing
+    allocations = allocation_num;
+    for (int i = 0; i < 1000; ++i) tree.RemoveVersion(tree.GetVersion(1 + i * 3));
+    std::cout << "allocations per RemoveVersion: " << double(allocation_num - allocations) / 1000 << std::endl;
+    REQUIRE(allocation_num == allocations);
+    // recycled records are used first, so only the arrays may grow
+    extra_allocations = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        allocations = allocation_num;
+        version = tree.Insert({int(rng() % 100000), 'c'}).first.version();
+        allocations = allocation_num - allocations;
+        extra_allocations += allocations - tree.CountOwnedNodes(version->root_);
+    }
+    REQUIRE(extra_allocations <= 6);
+    REQUIRE(tree.CheckTreeValidAllVersion());
+
+    // the lookup by time skips a long run of removed versions
+    auto time = tree.GetVersion(3299)->timestamp();
+    for (int i = 3000; i < 3300; ++i) tree.RemoveVersion(tree.GetVersion(i));
+    version = tree.LatestVersionAsOf(time);
+    REQUIRE(version != nullptr);
+    REQUIRE((version->id() == 2999 || (version->id() >= 3300 && version->timestamp() == time)));
+}
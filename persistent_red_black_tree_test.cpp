@@ -5,6 +5,12 @@
 #endif
 #include <catch/catch.hpp>
 
+#include <atomic>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+
 typedef PersistentRedBlackTreeTest<int, char> Tree;
 typedef Tree::ConstIterator CIterator;
 typedef Tree::Version* VersionPtr;
@@ -235,3 +241,1312 @@ TEST_CASE("figure 13.8 based (mainly for delete and remove version)", "")
     }
 
 }
+
+TEST_CASE("random operations on random versions", "")
+{
+    Tree tree;
+    std::vector<std::pair<VersionPtr, std::map<int, char>>> versions;
+    std::vector<NonConstValueType> require_values;
+    std::map<int, char> expected;
+    std::mt19937 rng(2022);
+    VersionPtr dependent_version;
+    size_t index;
+    int key;
+
+    for (int i = 0; i < 600; ++i)
+    {
+        key = rng() % 64;
+        if (versions.empty())
+        {
+            dependent_version = tree.EmptyVersion();
+            expected.clear();
+        }
+        else
+        {
+            index = rng() % versions.size();
+            dependent_version = versions[index].first;
+            expected = versions[index].second;
+        }
+        if (rng() % 2)
+        {
+            expected.insert({key, 'a' + i % 26});
+            versions.push_back({tree.Insert({key, 'a' + i % 26}, dependent_version).first.version(), expected});
+        }
+        else
+        {
+            expected.erase(key);
+            versions.push_back({tree.Delete(key, dependent_version).first, expected});
+        }
+        if (versions.size() > 32)
+        {
+            index = rng() % versions.size();
+            tree.RemoveVersion(versions[index].first);
+            versions.erase(versions.begin() + index);
+        }
+        for (auto& version : versions)
+        {
+            require_values.assign(version.second.begin(), version.second.end());
+            REQUIRE(tree.CheckTreeValid(version.first, require_values));
+        }
+    }
+}
+
+TEST_CASE("version id, parent and timestamp", "")
+{
+    Tree tree;
+    VersionPtr v1, v2, v3, v4;
+
+    v1 = tree.Insert({10, 'a'}).first.version();
+    v2 = tree.Insert({20, 'a'}).first.version();
+    v3 = tree.Insert({30, 'a'}, v1).first.version();
+    v4 = tree.Delete(10).first;
+
+    REQUIRE(v1->id() < v2->id());
+    REQUIRE(v2->id() < v3->id());
+    REQUIRE(v3->id() < v4->id());
+    REQUIRE(v1->parent_id() == Tree::kNilVersionId);
+    REQUIRE(v2->parent_id() == v1->id());
+    REQUIRE(v3->parent_id() == v1->id());
+    REQUIRE(v4->parent_id() == v3->id());
+    REQUIRE(v1->timestamp() <= v2->timestamp());
+    REQUIRE(v3->timestamp() <= v4->timestamp());
+
+    REQUIRE(tree.GetVersion(v1->id()) == v1);
+    REQUIRE(tree.GetVersion(v4->id()) == v4);
+    REQUIRE(tree.GetVersion(Tree::kNilVersionId) == nullptr);
+    REQUIRE(tree.GetVersion(v4->id() + 1) == nullptr);
+
+    REQUIRE(tree.LatestVersionAsOf(v1->timestamp() - std::chrono::seconds(1)) == nullptr);
+    REQUIRE(tree.LatestVersionAsOf(v4->timestamp()) == v4);
+    REQUIRE(tree.LatestVersionAsOf(v2->timestamp())->id() >= v2->id());
+    REQUIRE(tree.LatestVersionAsOf(v2->timestamp())->timestamp() == v2->timestamp());
+
+    Tree::VersionId v4_id = v4->id();
+    tree.RemoveVersion(v4);
+    REQUIRE(tree.GetVersion(v4_id) == nullptr);
+    REQUIRE(tree.LatestVersionAsOf(Tree::Clock::now()) == v3);
+    REQUIRE(tree.Insert({40, 'a'}).first.version()->id() > v4_id);
+}
+
+TEST_CASE("latest version after many removals", "")
+{
+    Tree tree;
+    std::vector<VersionPtr> versions;
+    std::size_t level_num;
+    int i;
+
+    for (i = 0; i < 5000; ++i) versions.push_back(tree.Insert({i, 'a'}).first.version());
+    level_num = tree.LiveIdLevelNum();
+    REQUIRE(level_num == 3);// 79 words of ids, 2 above them and 1 on top
+    REQUIRE(tree.CheckLiveIdsValid());
+
+    // the search reads at most two words per level, so removing almost every
+    // version leaves its cost as it was
+    for (i = 1; i < 5000; ++i)
+        if (i % 1000 != 0) tree.RemoveVersion(versions[i]);
+    REQUIRE(tree.LiveIdLevelNum() == level_num);
+    REQUIRE(tree.CheckLiveIdsValid());
+    REQUIRE(tree.LatestVersionAsOf(Tree::Clock::now()) == versions[4000]);
+
+    tree.RemoveVersion(versions[0]);
+    tree.RemoveVersion(versions[4000]);
+    REQUIRE(tree.CheckLiveIdsValid());
+    REQUIRE(tree.LatestVersionAsOf(Tree::Clock::now()) == versions[3000]);
+    for (i = 1000; i < 4000; i += 1000) tree.RemoveVersion(versions[i]);
+    REQUIRE(tree.CheckLiveIdsValid());
+    REQUIRE(tree.LatestVersionAsOf(Tree::Clock::now()) == nullptr);
+    for (i = 0; i < 100; ++i) tree.Insert({i, 'b'});
+    REQUIRE(tree.CheckLiveIdsValid());
+}
+
+TEST_CASE("three-way merge", "")
+{
+    Tree tree;
+    PersistentRedBlackTreeTest<int, int> counters;
+    std::map<int, char> base_values, our_values, their_values, merged_values;
+    std::vector<NonConstValueType> require_values;
+    std::mt19937 rng(2023);
+    VersionPtr base, ours, theirs, merged;
+    PersistentRedBlackTreeTest<int, int>::Version *counter_base, *counter_ours, *counter_theirs, *counter_merged;
+    int key, conflicts;
+
+    for (int i = 0; i < 200; ++i)
+    {
+        key = rng() % 400;
+        base_values.insert({key, 'a'});
+        base = tree.Insert({key, 'a'}).first.version();
+    }
+    ours = theirs = base;
+    our_values = their_values = base_values;
+    for (int i = 0; i < 30; ++i)
+    {
+        key = rng() % 400;
+        if (rng() % 2)
+        {
+            our_values[key] = 'b';
+            ours = tree.InsertOrAssign({key, 'b'}, ours).first.version();
+        }
+        else
+        {
+            our_values.erase(key);
+            ours = tree.Delete(key, ours).first;
+        }
+        key = rng() % 400;
+        if (rng() % 2)
+        {
+            their_values[key] = 'c';
+            theirs = tree.InsertOrAssign({key, 'c'}, theirs).first.version();
+        }
+        else
+        {
+            their_values.erase(key);
+            theirs = tree.Delete(key, theirs).first;
+        }
+    }
+
+    // conflicts go to theirs; '\0' stands for an absent key
+    auto lookup = [](const std::map<int, char>& values, int key)
+    {
+        return values.count(key) ? values.at(key) : '\0';
+    };
+    for (int key = 0; key < 400; ++key)
+    {
+        char base_value, our_value, their_value, merged_value;
+        base_value = lookup(base_values, key);
+        our_value = lookup(our_values, key);
+        their_value = lookup(their_values, key);
+        merged_value = (our_value != base_value && their_value == base_value) ? our_value : their_value;
+        if (merged_value != '\0') merged_values[key] = merged_value;
+    }
+    conflicts = 0;
+    merged = tree.Merge(base, ours, theirs, 
+        [&](const int& key, const char* base_value, const char* our_value, const char* their_value)
+        {
+            ++conflicts;
+            REQUIRE((base_value == nullptr) == (base_values.count(key) == 0));
+            REQUIRE((our_value == nullptr) == (our_values.count(key) == 0));
+            return their_value == nullptr ? std::make_pair(false, '\0') : std::make_pair(true, *their_value);
+        });
+    require_values.assign(merged_values.begin(), merged_values.end());
+    REQUIRE(conflicts > 0);
+    REQUIRE(tree.CheckTreeValid(merged, require_values));
+    REQUIRE(merged->parent_id() == ours->id());
+
+    // merging unchanged branches shares the whole tree
+    REQUIRE(tree.Merge(base, base, ours, [](const int&, const char*, const char*, const char*) 
+        { return std::make_pair(false, '\0'); })->root_ == ours->root_);
+
+    // a resolver may compute a value it does not keep anywhere, e.g. merging counters
+    counters.Insert({1, 10});
+    counters.Insert({2, 20});
+    counter_base = counters.GetVersion(2);
+    counter_ours = counters.InsertOrAssign({1, 11}, counter_base).first.version();
+    counter_theirs = counters.InsertOrAssign({1, 15}, counter_base).first.version();
+    counter_theirs = counters.Delete(2, counter_theirs).first;
+    counter_merged = counters.Merge(counter_base, counter_ours, counter_theirs,
+        [](const int&, const int* base_value, const int* our_value, const int* their_value)
+        {
+            return std::make_pair(true, *our_value + *their_value - *base_value);
+        });
+    REQUIRE(counters.CheckTreeValid(counter_merged, {{1, 16}}));
+
+    tree.RemoveVersion(base);
+    tree.RemoveVersion(ours);
+    tree.RemoveVersion(theirs);
+    REQUIRE(tree.CheckTreeValid(merged, require_values));
+    REQUIRE(tree.CheckTreeValidAllVersion());
+}
+
+TEST_CASE("freeze a version", "")
+{
+    Tree tree;
+    PersistentRedBlackTreeTest<std::string, int> string_tree;
+    FrozenVersion<int, char> frozen, empty_frozen;
+    FrozenVersion<std::string, int> string_frozen;
+    FrozenVersion<int, char>::ConstIterator it;
+    VersionPtr version;
+    int i;
+
+    empty_frozen = tree.Freeze(tree.EmptyVersion());
+    REQUIRE(empty_frozen.Size() == 0);
+    REQUIRE(empty_frozen.Find(1) == empty_frozen.CEnd());
+    REQUIRE(empty_frozen.LowerBound(1) == empty_frozen.CEnd());
+
+    for (i = 0; i < 1000; ++i) version = tree.Insert({i * 2, 'a' + i % 26}).first.version();
+    frozen = tree.Freeze(version);
+    tree.RemoveVersion(version);
+    tree.Clear();
+    REQUIRE(frozen.Size() == 1000);
+    for (i = -1; i < 2001; ++i)
+    {
+        it = frozen.LowerBound(i);
+        if (i >= 1999)
+        {
+            REQUIRE(it == frozen.CEnd());
+        }
+        else
+        {
+            REQUIRE(it->first == (i < 0 ? 0 : (i + 1) / 2 * 2));
+        }
+        if (i >= 0 && i < 2000 && i % 2 == 0)
+        {
+            REQUIRE(frozen.Find(i)->first == i);
+            REQUIRE(frozen.At(i) == 'a' + i / 2 % 26);
+        }
+        else
+        {
+            REQUIRE(frozen.Find(i) == frozen.CEnd());
+            REQUIRE_THROWS_AS(frozen.At(i), std::out_of_range);
+        }
+    }
+    for (i = 0, it = frozen.CBegin(); it != frozen.CEnd(); ++i, ++it)
+        REQUIRE(it->first == i * 2);
+    REQUIRE(i == 1000);
+
+    for (i = 0; i < 100; ++i) 
+        string_tree.Insert({std::to_string(i), i});
+    string_frozen = string_tree.Freeze(string_tree.GetVersion(100));
+    REQUIRE(string_frozen.Size() == 100);
+    for (i = 0; i < 100; ++i)
+        REQUIRE(string_frozen.At(std::to_string(i)) == i);
+    REQUIRE(string_frozen.LowerBound("55")->first == "55");
+    REQUIRE(string_frozen.LowerBound("551")->first == "56");
+    REQUIRE(string_frozen.LowerBound("991") == string_frozen.CEnd());
+}
+
+TEST_CASE("batched lookups", "")
+{
+    Tree tree;
+    std::vector<int> keys;
+    std::vector<CIterator> found;
+    std::vector<char> values;
+    std::mt19937 rng(2024);
+    VersionPtr version;
+
+    tree.FindMany(keys, tree.EmptyVersion(), found);
+    REQUIRE(found.empty());
+    keys = {1, 2, 3};
+    tree.FindMany(keys, tree.EmptyVersion(), found);
+    REQUIRE(found.size() == 3);
+    REQUIRE(found[0] == tree.CEnd());
+
+    for (int i = 0; i < 3000; ++i) version = tree.Insert({rng() % 6000, 'a' + i % 26}).first.version();
+    keys.clear();
+    for (int i = 0; i < 1000; ++i) keys.push_back(rng() % 6200 - 100);
+    for (int sorted = 0; sorted < 2; ++sorted)
+    {
+        if (sorted) std::sort(keys.begin(), keys.end());
+        tree.FindMany(keys, version, found);
+        REQUIRE(found.size() == keys.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            REQUIRE(found[i] == tree.Find(keys[i], version));
+            REQUIRE(found[i].version() == version);
+        }
+    }
+
+    keys.clear();
+    for (CIterator it = tree.CBegin(version); it != tree.CEnd(); ++it) keys.push_back(it->first);
+    std::reverse(keys.begin(), keys.end());
+    tree.AtMany(keys, version, values);
+    REQUIRE(values.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) REQUIRE(values[i] == tree.At(keys[i], version));
+    keys.push_back(-1);
+    REQUIRE_THROWS_AS(tree.AtMany(keys, version, values), std::out_of_range);
+
+    // a set has nothing mapped, but its lookups still check every key
+    PersistentRedBlackSet<int> set;
+    std::vector<SetMapped> mapped;
+    set.Insert(1);
+    set.AtMany({1, 1}, set.GetVersion(1), mapped);
+    REQUIRE(mapped.size() == 2);
+    REQUIRE_THROWS_AS(set.AtMany({1, 2}, set.GetVersion(1), mapped), std::out_of_range);
+}
+
+TEST_CASE("range aggregates", "")
+{
+    typedef PersistentRedBlackTreeTest<int, long long, SumAggregate<long long>> SumTree;
+    SumTree sum_tree;
+    PersistentRedBlackTreeTest<int, long long, MinAggregate<long long>> min_tree;
+    PersistentRedBlackTreeTest<int, long long, CountAggregate> count_tree;
+    std::vector<std::pair<SumTree::Version*, std::map<int, long long>>> versions;
+    std::mt19937 rng(2025);
+    struct PlainNode
+    {
+        decltype(PersistentRedBlackTreeTest<int, char>::Node::left) left;
+        decltype(PersistentRedBlackTreeTest<int, char>::Node::right) right;
+        decltype(PersistentRedBlackTreeTest<int, char>::Node::value) value;
+        decltype(PersistentRedBlackTreeTest<int, char>::Node::color) color;
+        decltype(PersistentRedBlackTreeTest<int, char>::Node::use_count) use_count;
+    };
+    long long sum;
+    int lower, upper;
+
+    // without a monoid, a node is no bigger than its own members
+    REQUIRE(sizeof(PersistentRedBlackTreeTest<int, char>::Node) == sizeof(PlainNode));
+    REQUIRE(sum_tree.RangeAggregate(0, 100, sum_tree.EmptyVersion()) == 0);
+
+    REQUIRE(sum_tree.RandomVersionWalk(versions, rng, 400, 32,
+        [&](int, SumTree::Version* version, std::map<int, long long> expected)
+        {
+            int key;
+            long long value;
+            key = rng() % 200;
+            value = rng() % 1000 - 500;
+            switch (rng() % 3)
+            {
+            case 0:
+                expected.insert({key, value});
+                versions.push_back({sum_tree.Insert({key, value}, version).first.version(), expected});
+                break;
+            case 1:
+                expected[key] = value;
+                versions.push_back({sum_tree.InsertOrAssign({key, value}, version).first.version(), expected});
+                break;
+            default:
+                expected.erase(key);
+                versions.push_back({sum_tree.Delete(key, version).first, expected});
+                break;
+            }
+        }));
+    for (auto& version : versions)
+    {
+        for (int j = 0; j < 10; ++j)
+        {
+            lower = rng() % 220 - 10;
+            upper = lower + rng() % 100;
+            sum = 0;
+            for (auto it = version.second.lower_bound(lower); it != version.second.end() && it->first < upper; ++it)
+                sum += it->second;
+            REQUIRE(sum_tree.RangeAggregate(lower, upper, version.first) == sum);
+        }
+    }
+
+    for (int i = 0; i < 100; ++i)
+    {
+        min_tree.Insert({i, (i * 37) % 101});
+        count_tree.Insert({i * 2, 0});
+    }
+    for (int i = 50; i < 80; ++i) min_tree.Delete(i);
+    auto min_version = min_tree.GetVersion(130);
+    REQUIRE(min_tree.RangeAggregate(0, 100, min_version) == 0);
+    REQUIRE(min_tree.RangeAggregate(1, 100, min_version) == 2);// 71 * 37 % 101 == 1 is deleted, 41 * 37 % 101 == 2
+    REQUIRE(min_tree.RangeAggregate(50, 80, min_version) == std::numeric_limits<long long>::max());
+    REQUIRE(count_tree.RangeAggregate(10, 21, count_tree.GetVersion(100)) == 6);
+    REQUIRE(count_tree.RangeAggregate(-5, 1000, count_tree.GetVersion(50)) == 50);
+}
+
+TEST_CASE("split and join", "")
+{
+    typedef PersistentRedBlackTreeTest<int, long long, SumAggregate<long long>> SumTree;
+    SumTree tree;
+    std::vector<std::pair<SumTree::Version*, std::vector<std::pair<int, long long>>>> versions;
+    std::vector<std::pair<int, long long>> values;
+    std::mt19937 rng(32);
+    int key;
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        key = rng() % 4000;
+        tree.InsertOrAssign({key, i});
+    }
+    for (auto it = tree.CBegin(tree.GetVersion(1000)); it != tree.CEnd(); ++it)
+        values.push_back(*it);
+    versions.push_back({tree.GetVersion(1000), values});
+    REQUIRE(tree.RandomVersionWalk(versions, rng, 300, 40,
+        [&](int, SumTree::Version* version, std::vector<std::pair<int, long long>> values)
+        {
+            std::pair<SumTree::Version*, SumTree::Version*> split;
+            std::vector<std::pair<int, long long>> left_values, right_values;
+            long long sum;
+            size_t middle;
+            int key;
+            if (rng() % 2 == 0 || versions.size() < 2)
+            {
+                key = rng() % 4200 - 100;
+                split = tree.Split(version, key);
+                middle = std::lower_bound(values.begin(), values.end(), std::make_pair(key, (long long)-1)) - values.begin();
+                left_values.assign(values.begin(), values.begin() + middle);
+                right_values.assign(values.begin() + middle, values.end());
+                REQUIRE(tree.CheckTreeValid(version, values));
+                REQUIRE(split.first->parent_id() == version->id());
+                REQUIRE(split.second->parent_id() == version->id());
+                // only O(lg n) nodes are new; the rest is shared with the source
+                REQUIRE(tree.CountOwnedNodes(split.first->root_) + tree.CountOwnedNodes(split.second->root_) <= 80);
+                sum = 0;
+                for (auto& value : left_values) sum += value.second;
+                REQUIRE(tree.RangeAggregate(-1000, 5000, split.first) == sum);
+                versions.push_back({split.first, left_values});
+                versions.push_back({split.second, right_values});
+            }
+            else
+            {
+                // join two pieces cut from the same version at the same key
+                middle = rng() % (versions.size() - 1);
+                if (versions[middle].second.empty() || versions[middle + 1].second.empty() ||
+                    versions[middle].second.back().first < versions[middle + 1].second.front().first)
+                {
+                    values = versions[middle].second;
+                    values.insert(values.end(), versions[middle + 1].second.begin(), versions[middle + 1].second.end());
+                    versions.push_back({tree.Join(versions[middle].first, versions[middle + 1].first), values});
+                    REQUIRE(tree.CheckTreeValid(versions[middle].first, versions[middle].second));
+                    REQUIRE(tree.CheckTreeValid(versions[middle + 1].first, versions[middle + 1].second));
+                    sum = 0;
+                    for (auto& value : values) sum += value.second;
+                    REQUIRE(tree.RangeAggregate(-1000, 5000, versions.back().first) == sum);
+                }
+                else
+                {
+                    REQUIRE_THROWS_AS(tree.Join(versions[middle].first, versions[middle + 1].first), std::invalid_argument);
+                }
+            }
+        }));
+}
+
+TEST_CASE("delete a range of keys", "")
+{
+    typedef PersistentRedBlackTreeTest<int, long long, CountAggregate> CountTree;
+    CountTree tree;
+    std::vector<std::pair<CountTree::Version*, std::map<int, long long>>> versions;
+    CountTree::Version* version;
+    std::map<int, long long> expected;
+    std::mt19937 rng(33);
+    int key;
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        key = rng() % 10000;
+        tree.InsertOrAssign({key, i});
+        expected[key] = i;
+    }
+    versions.push_back({tree.GetVersion(2000), expected});
+    REQUIRE(tree.RandomVersionWalk(versions, rng, 200, 20,
+        [&](int i, CountTree::Version* dependent_version, std::map<int, long long> expected)
+        {
+            CountTree::Version* version;
+            int lower, upper;
+            lower = rng() % 10200 - 100;
+            upper = lower + rng() % (i % 2 == 0 ? 100 : 5000);
+            expected.erase(expected.lower_bound(lower), expected.lower_bound(upper));
+            version = tree.DeleteRange(lower, upper, dependent_version);
+            // a single new version, derived from the dependent one
+            REQUIRE(version->id() == size_t(2001 + i));
+            REQUIRE(version->parent_id() == dependent_version->id());
+            REQUIRE(tree.CountOwnedNodes(version->root_) <= 100);
+            REQUIRE(tree.RangeAggregate(-1000, 20000, version) == expected.size());
+            versions.push_back({version, expected});
+        }));
+
+    // the latest version by default; an empty range changes nothing
+    version = tree.DeleteRange(-1000, 20000, versions.back().first);
+    REQUIRE(tree.CheckTreeValid(version, {}));
+    REQUIRE(tree.DeleteRange(5, 5)->root_ == version->root_);
+    REQUIRE(tree.DeleteRange(5, 1, versions.back().first)->root_ == versions.back().first->root_);
+}
+
+TEST_CASE("history of a key", "")
+{
+    Tree tree;
+    std::vector<VersionPtr> versions;
+    std::vector<CIterator> history, parallel_history;
+    std::mt19937 rng(34);
+    int key;
+
+    for (int i = 0; i < 3000; ++i)
+    {
+        key = rng() % 500;
+        if (rng() % 3 == 0)
+            versions.push_back(tree.Delete(key).first);
+        else
+            versions.push_back(tree.InsertOrAssign({key, 'a' + i % 26}).first.version());
+    }
+    // also out of order and repeated
+    for (int i = 0; i < 500; ++i) versions.push_back(versions[rng() % versions.size()]);
+    for (key = -1; key <= 500; key += 25)
+    {
+        tree.HistoryOf(key, versions, history);
+        tree.HistoryOf(key, versions, parallel_history, 4);
+        REQUIRE(history.size() == versions.size());
+        REQUIRE(parallel_history.size() == versions.size());
+        for (size_t i = 0; i < versions.size(); ++i)
+        {
+            REQUIRE(history[i] == tree.Find(key, versions[i]));
+            REQUIRE(parallel_history[i] == history[i]);
+            REQUIRE(history[i].version() == versions[i]);
+        }
+    }
+    tree.HistoryOf(7, std::vector<VersionPtr>(), history, 3);
+    REQUIRE(history.empty());
+}
+
+TEST_CASE("set, multimap and multiset", "")
+{
+    typedef PersistentRedBlackTreeTest<int, int, CountAggregate, true> MultiMap;
+    PersistentRedBlackTreeTest<long long, SetMapped> set;
+    MultiMap multimap;
+    PersistentRedBlackTreeTest<int, SetMapped, NoAggregate, true> multiset;
+    std::vector<std::pair<MultiMap::Version*, std::multimap<int, int>>> versions;
+    std::mt19937 rng(35);
+    int key;
+
+    // a set stores the key alone
+    REQUIRE(sizeof(PersistentRedBlackTreeTest<long long, SetMapped>::Node) <
+        sizeof(PersistentRedBlackTreeTest<long long, char>::Node));
+    REQUIRE(set.Insert(5).second);
+    REQUIRE(set.Insert(3).second);
+    REQUIRE(set.Insert(5).second == false);
+    REQUIRE(*set.CBegin(set.GetVersion(3)) == 3);
+    REQUIRE(*++set.CBegin(set.GetVersion(3)) == 5);
+    REQUIRE(set.Find(5, set.GetVersion(1)) != set.CEnd());
+    REQUIRE(set.Find(3, set.GetVersion(1)) == set.CEnd());
+    REQUIRE(set.Delete(5).second);
+    REQUIRE(set.Find(5, set.GetVersion(4)) == set.CEnd());
+    REQUIRE(set.CheckRBSubtreeValid(set.GetVersion(4)->root_) != -1);
+
+    // equal keys keep their insertion order, across versions and splits
+    REQUIRE(multimap.RandomVersionWalk(versions, rng, 2000, 30,
+        [&](int i, MultiMap::Version* version, std::multimap<int, int> expected)
+        {
+            std::pair<MultiMap::Version*, MultiMap::Version*> split;
+            int key;
+            key = rng() % 20;
+            if (i % 50 == 0)
+            {
+                key = rng() % 22 - 1;
+                split = multimap.Split(version, key);
+                REQUIRE(multimap.RangeAggregate(-100, 100, split.first) ==
+                    size_t(std::distance(expected.begin(), expected.lower_bound(key))));
+                versions.push_back({multimap.Join(split.first, split.second), expected});
+                multimap.RemoveVersion(split.first);
+                multimap.RemoveVersion(split.second);
+            }
+            else if (rng() % 3 == 0)
+            {
+                auto delete_result = multimap.Delete(key, version);
+                REQUIRE(delete_result.second == (expected.find(key) != expected.end()));
+                if (delete_result.second) expected.erase(expected.find(key));// the first inserted
+                versions.push_back({delete_result.first, expected});
+            }
+            else
+            {
+                auto insert_result = multimap.Insert({key, i}, version);
+                REQUIRE(insert_result.second);
+                expected.insert({key, i});
+                versions.push_back({insert_result.first.version(), expected});
+            }
+        }));
+    for (auto& version : versions)
+    {
+        for (key = 0; key < 20; ++key)
+        {
+            if (version.second.find(key) == version.second.end())
+                REQUIRE(multimap.Find(key, version.first) == multimap.CEnd());
+            else
+                REQUIRE(multimap.At(key, version.first) == version.second.find(key)->second);
+        }
+    }
+    // a multiset keeps every copy of a key
+    for (int i = 0; i < 10; ++i) multiset.Insert(i % 3);
+    multiset.Delete(1);
+    key = 0;
+    for (auto it = multiset.CBegin(multiset.GetVersion(11)); it != multiset.CEnd(); ++it) key = key * 10 + *it;
+    REQUIRE(key == 11222);// 0 0 0 0 1 1 2 2 2
+}
+
+// an int that counts the comparisons made between such keys
+struct CountedKey
+{
+    static std::size_t comparison_num;
+    int value;
+    CountedKey(int value = 0) : value(value) {}
+    bool operator<(const CountedKey& other) const { ++comparison_num; return value < other.value; }
+    bool operator==(const CountedKey& other) const { ++comparison_num; return value == other.value; }
+};
+std::size_t CountedKey::comparison_num = 0;
+
+TEST_CASE("finger search and hinted insert", "")
+{
+    Tree tree;
+    PersistentRedBlackTreeTest<CountedKey, char> counted_hinted, counted_plain;
+    PersistentRedBlackTreeTest<CountedKey, char>::CIterator counted_hint;
+    std::size_t hinted_comparison_num, plain_comparison_num;
+    PersistentRedBlackTreeTest<int, int, NoAggregate, true> multimap;
+    PersistentRedBlackTreeTest<int, int, NoAggregate, true>::CIterator multimap_hint;
+    std::vector<NonConstValueType> require_values;
+    std::map<int, char> expected;
+    std::multimap<int, int> expected_multimap;
+    CIterator hint, it;
+    VersionPtr version;
+    std::mt19937 rng(36);
+    int key;
+
+    // appends follow the right spine of the cached maximum
+    for (int i = 0; i < 1000; ++i)
+    {
+        tree.Insert({i * 2, 'a' + i % 26});
+        expected[i * 2] = 'a' + i % 26;
+    }
+    version = tree.GetVersion(1000);
+    require_values.assign(expected.begin(), expected.end());
+    REQUIRE(tree.CheckTreeValid(version, require_values));
+    REQUIRE(tree.CheckTreeValid(tree.GetVersion(500)));
+    REQUIRE(version->rightmost_->value.first == 1998);
+
+    // a walk of nearby keys, found from the previous position
+    hint = tree.CBegin(version);
+    key = 0;
+    for (int i = 0; i < 2000; ++i)
+    {
+        key = std::max(-5, std::min(2005, key + int(rng() % 21) - 10));
+        it = tree.Find(key, hint);
+        REQUIRE(it == tree.Find(key, version));
+        if (it != tree.CEnd()) hint = it;
+    }
+    // hinted inserts near the hint, on a chain of versions
+    hint = tree.Find(1000, version);
+    for (int i = 0; i < 500; ++i)
+    {
+        key = hint->first + int(rng() % 41) - 20;
+        auto insert_result = tree.Insert({key, 'z'}, hint);
+        REQUIRE(insert_result.second == (expected.count(key) == 0));
+        expected.insert({key, 'z'});
+        REQUIRE(insert_result.first->first == key);
+        REQUIRE(insert_result.first.version()->parent_id() == hint.version()->id());
+        hint = insert_result.first;
+    }
+    require_values.assign(expected.begin(), expected.end());
+    REQUIRE(tree.CheckTreeValid(hint.version(), require_values));
+    REQUIRE(tree.CheckTreeValidAllVersion());
+    // hints from other versions, and the version of the finger removed
+    tree.RemoveVersion(hint.version());
+    REQUIRE(tree.Find(6, tree.CBegin(tree.GetVersion(3))) == tree.CEnd());
+    REQUIRE(tree.Find(2, tree.CBegin(tree.GetVersion(3)))->first == 2);
+    REQUIRE(tree.Insert({-1, 'b'}, tree.CEnd()).first.version()->parent_id() == Tree::kNilVersionId);
+
+    // a hinted insert near its hint compares fewer keys than one from the root
+    for (int i = 0; i < 50000; ++i)
+    {
+        counted_hinted.Insert({CountedKey(i * 2), 'a'});
+        counted_plain.Insert({CountedKey(i * 2), 'a'});
+    }
+    counted_hint = counted_hinted.Find(CountedKey(50000), counted_hinted.GetVersion(50000));
+    hinted_comparison_num = plain_comparison_num = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        key = counted_hint->first.value + int(rng() % 9) - 4;
+        CountedKey::comparison_num = 0;
+        counted_hint = counted_hinted.Insert({CountedKey(key), 'z'}, counted_hint).first;
+        hinted_comparison_num += CountedKey::comparison_num;
+        CountedKey::comparison_num = 0;
+        counted_plain.Insert({CountedKey(key), 'z'});
+        plain_comparison_num += CountedKey::comparison_num;
+        REQUIRE(counted_hint->first.value == key);
+    }
+    REQUIRE(hinted_comparison_num * 2 < plain_comparison_num);
+    REQUIRE(counted_hinted.CheckTreeValid(counted_hint.version()));
+
+    // equal keys: the first inserted is found, new ones go after the equal keys
+    for (int i = 0; i < 300; ++i)
+    {
+        key = rng() % 30;
+        auto insert_result = i == 0 ? multimap.Insert({key, i}) : multimap.Insert({key, i}, multimap_hint);
+        expected_multimap.insert({key, i});
+        multimap_hint = insert_result.first;
+        auto found = multimap.Find(int(rng() % 30), multimap_hint);
+        if (found != multimap.CEnd())
+        {
+            REQUIRE(found->second == expected_multimap.find(found->first)->second);
+            multimap_hint = found;
+        }
+    }
+    auto multimap_it = multimap.CBegin(multimap.GetVersion(300));
+    for (auto& value : expected_multimap)
+    {
+        REQUIRE(multimap_it->first == value.first);
+        REQUIRE(multimap_it->second == value.second);
+        ++multimap_it;
+    }
+    REQUIRE(multimap_it == multimap.CEnd());
+}
+
+TEST_CASE("min, max and pop", "")
+{
+    Tree tree;
+    typedef PersistentRedBlackTreeTest<int, int, CountAggregate, true> PriorityQueue;
+    PriorityQueue multimap;
+    std::vector<PriorityQueue::VersionPtr> versions;
+    std::pair<PriorityQueue::VersionPtr, bool> queue_pop_result;
+    std::map<int, char> expected;
+    std::vector<NonConstValueType> require_values;
+    std::multimap<int, int> expected_multimap;
+    std::pair<VersionPtr, bool> pop_result;
+    VersionPtr version;
+    std::mt19937 rng(37);
+    int key;
+
+    REQUIRE(tree.Min(tree.EmptyVersion()) == tree.CEnd());
+    REQUIRE(tree.Max(tree.EmptyVersion()) == tree.CEnd());
+    pop_result = tree.PopMin(tree.EmptyVersion());
+    REQUIRE(pop_result.second == false);
+    REQUIRE(tree.CheckTreeValid(pop_result.first));
+
+    // every kind of update keeps the ends
+    for (int i = 0; i < 3000; ++i)
+    {
+        key = rng() % 500;
+        switch (rng() % 6)
+        {
+        case 0:
+        case 1:
+            tree.Insert({key, 'a' + i % 26});
+            expected.insert({key, 'a' + i % 26});
+            break;
+        case 2:
+            tree.InsertOrAssign({key, 'A' + i % 26});
+            expected[key] = 'A' + i % 26;
+            break;
+        case 3:
+            // the minimum half of the time
+            if (expected.empty() == false && rng() % 2) key = expected.begin()->first;
+            tree.Delete(key);
+            expected.erase(key);
+            break;
+        case 4:
+            pop_result = tree.PopMin();
+            REQUIRE(pop_result.second == (expected.empty() == false));
+            if (expected.empty() == false) expected.erase(expected.begin());
+            break;
+        default:
+            pop_result = tree.PopMax();
+            REQUIRE(pop_result.second == (expected.empty() == false));
+            if (expected.empty() == false) expected.erase(std::prev(expected.end()));
+            break;
+        }
+        version = tree.GetVersion(i + 2);
+        require_values.assign(expected.begin(), expected.end());
+        REQUIRE(tree.CheckTreeValid(version, require_values));
+        if (expected.empty() == false)
+        {
+            REQUIRE(tree.Min(version)->first == expected.begin()->first);
+            REQUIRE(tree.Max(version)->first == expected.rbegin()->first);
+        }
+    }
+    REQUIRE(tree.CheckTreeValidAllVersion());
+    // the ends of versions built by split, join and range deletion
+    version = tree.Insert({1000, 'z'}).first.version();
+    auto split_result = tree.Split(version, 250);
+    REQUIRE(tree.CheckTreeValid(split_result.first));
+    REQUIRE(tree.CheckTreeValid(split_result.second));
+    REQUIRE(tree.Max(split_result.second)->first == 1000);
+    REQUIRE(tree.CheckTreeValid(tree.Join(split_result.first, split_result.second)));
+    REQUIRE(tree.CheckTreeValid(tree.DeleteRange(0, 100, version)));
+    REQUIRE(tree.CheckTreeValid(tree.DeleteRange(-1, 2000, version)));
+
+    // a versioned priority queue with equal priorities, popped in insertion order
+    for (int i = 0; i < 200; ++i)
+    {
+        key = rng() % 20;
+        multimap.Insert({key, i});
+        expected_multimap.insert({key, i});
+    }
+    versions.push_back(multimap.GetVersion(200));
+    while (expected_multimap.empty() == false)
+    {
+        REQUIRE(multimap.Min(versions.back())->second == expected_multimap.begin()->second);
+        REQUIRE(multimap.Max(versions.back())->second == std::prev(expected_multimap.end())->second);
+        if (expected_multimap.size() % 2)
+        {
+            queue_pop_result = multimap.PopMin(versions.back());
+            expected_multimap.erase(expected_multimap.begin());
+        }
+        else
+        {
+            queue_pop_result = multimap.PopMax(versions.back());
+            expected_multimap.erase(std::prev(expected_multimap.end()));
+        }
+        REQUIRE(queue_pop_result.second);
+        REQUIRE(multimap.CheckRBSubtreeValid(queue_pop_result.first->root_) != -1);
+        REQUIRE(multimap.CheckExtremesValid(queue_pop_result.first));
+        REQUIRE(multimap.RangeAggregate(-1, 100, queue_pop_result.first) == expected_multimap.size());
+        versions.push_back(queue_pop_result.first);
+    }
+    // older versions are untouched
+    REQUIRE(multimap.Min(versions[0])->first == multimap.CBegin(versions[0])->first);
+    REQUIRE(std::distance(multimap.CBegin(versions[0]), multimap.CEnd()) == 200);
+}
+
+TEST_CASE("deduplicate independently built versions", "")
+{
+    Tree tree;
+    PersistentRedBlackTreeTest<int, int, SumAggregate<int>, true> multimap;
+    std::vector<NonConstValueType> require_values;
+    std::vector<VersionPtr> versions, chain_ends;
+    VersionPtr version, other_version;
+    int key_num;
+
+    // the same bulk load twice, then one copy with a different value
+    key_num = 1000;
+    for (int copy = 0; copy < 3; ++copy)
+    {
+        version = tree.EmptyVersion();
+        for (int i = 0; i < key_num; ++i)
+        {
+            other_version = tree.Insert({i, copy == 2 && i == 500 ? 'b' : 'a'}, version).first.version();
+            if (version != tree.EmptyVersion()) tree.RemoveVersion(version);
+            version = other_version;
+        }
+        chain_ends.push_back(version);
+    }
+    REQUIRE(tree.CountDistinctNodes(chain_ends) == size_t(3 * key_num));
+    // a version sharing nodes with the first copy, left out of the pass
+    other_version = tree.Insert({-1, 'c'}, chain_ends[0]).first.version();
+    tree.Deduplicate(chain_ends);
+    REQUIRE(chain_ends[0]->root_ == chain_ends[1]->root_);
+    // the copy with another value shares all but the path to that value
+    REQUIRE(tree.CountDistinctNodes(chain_ends) < size_t(key_num + 30));
+    for (int i = 0; i < key_num; ++i) require_values.push_back({i, 'a'});
+    REQUIRE(tree.CheckTreeValid(chain_ends[0], require_values));
+    REQUIRE(tree.CheckTreeValid(chain_ends[1], require_values));
+    require_values[500].second = 'b';
+    REQUIRE(tree.CheckTreeValid(chain_ends[2], require_values));
+    require_values[500].second = 'a';
+    require_values.insert(require_values.begin(), {-1, 'c'});
+    REQUIRE(tree.CheckTreeValid(other_version, require_values));
+    // updates after the pass copy the shared nodes as usual
+    version = tree.Delete(0, chain_ends[1]).first;
+    REQUIRE(tree.Find(0, chain_ends[0]) != tree.CEnd());
+    REQUIRE(tree.Find(0, version) == tree.CEnd());
+    REQUIRE(tree.CheckTreeValidAllVersion());
+    tree.RemoveVersion(chain_ends[0]);
+    tree.RemoveVersion(other_version);
+    tree.Deduplicate({chain_ends[1], chain_ends[1], version});
+    REQUIRE(tree.CheckTreeValid(chain_ends[1]));
+    REQUIRE(tree.CheckTreeValid(version));
+
+    // equal keys count as equal only with the same insertion order
+    for (int copy = 0; copy < 2; ++copy)
+    {
+        for (int i = 0; i < 100; ++i)
+            multimap.Insert({i % 10, i}, i == 0 ? multimap.EmptyVersion() : multimap.GetVersion(copy * 100 + i));
+    }
+    multimap.Deduplicate({multimap.GetVersion(100), multimap.GetVersion(200)});
+    REQUIRE(multimap.RangeAggregate(0, 10, multimap.GetVersion(100)) == 4950);
+    REQUIRE(multimap.RangeAggregate(0, 10, multimap.GetVersion(200)) == 4950);
+    REQUIRE(multimap.CheckExtremesValid(multimap.GetVersion(200)));
+    REQUIRE(multimap.CountDistinctNodes({multimap.GetVersion(100), multimap.GetVersion(200)}) > 100);
+}
+
+TEST_CASE("compact a version", "")
+{
+    Tree tree;
+    std::map<int, char> expected;
+    std::vector<NonConstValueType> require_values;
+    std::vector<const Tree::Node*> shared_nodes, shared_nodes_after;
+    std::mt19937 rng(40);
+    VersionPtr version, other_version;
+    uintptr_t lowest, highest;
+    size_t owned_num;
+    int key;
+
+    // scatter the nodes with many updates and removals
+    for (int i = 0; i < 20000; ++i)
+    {
+        key = rng() % 3000;
+        if (rng() % 3)
+        {
+            tree.InsertOrAssign({key, 'a' + i % 26});
+            expected[key] = 'a' + i % 26;
+        }
+        else
+        {
+            tree.Delete(key);
+            expected.erase(key);
+        }
+        if (i > 10 && rng() % 4) tree.RemoveVersion(tree.GetVersion(i - 10));
+    }
+    version = tree.GetVersion(20000);
+    other_version = tree.Insert({-1, 'z'}, version).first.version();
+    tree.CollectSharedNodes(version->root_, shared_nodes);
+    owned_num = tree.CountOwnedNodes(version->root_);
+    REQUIRE(owned_num > 0);
+    tree.Compact(version);
+    require_values.assign(expected.begin(), expected.end());
+    REQUIRE(tree.CheckTreeValid(version, require_values));
+    require_values.insert(require_values.begin(), {-1, 'z'});
+    REQUIRE(tree.CheckTreeValid(other_version, require_values));
+    REQUIRE(tree.CheckTreeValidAllVersion());
+    // the nodes only this version uses now fill one block
+    lowest = UINTPTR_MAX;
+    highest = 0;
+    tree.BoundOwnedNodes(version->root_, lowest, highest);
+    REQUIRE(tree.CountOwnedNodes(version->root_) == owned_num);
+    REQUIRE(highest - lowest == (owned_num - 1) * sizeof(Tree::Node));
+    REQUIRE(tree.ArenaNum() == 1);
+    // nodes other versions point at stay where they are
+    tree.CollectSharedNodes(version->root_, shared_nodes_after);
+    REQUIRE(shared_nodes_after == shared_nodes);
+    // compacting again, then updating and removing, frees the blocks through their nodes
+    tree.Compact(version);
+    REQUIRE(tree.ArenaNum() == 1);
+    for (int i = 0; i < 100; ++i) tree.Delete(int(rng() % 3000), version);
+    tree.RemoveVersion(version);
+    REQUIRE(tree.CheckTreeValidAllVersion());
+    tree.Clear();
+    REQUIRE(tree.ArenaNum() == 0);
+
+    // compaction of the versions read often enough, only when asked for
+    for (int i = 0; i < 2000; ++i) tree.Insert({int(rng() % 3000), 'b'});
+    version = tree.Insert({0, 'b'}).first.version();
+    tree.SetCompactionThreshold(100, Tree::Clock::duration::zero());
+    for (int i = 0; i < 99; ++i) tree.Find(i, version);
+    REQUIRE(tree.CompactHotVersions() == 0);
+    tree.Find(99, version);
+    auto hint = tree.Find(0, version);
+    for (int i = 0; i < 2; ++i) tree.Insert({-i - 1, 'c'}, version);
+    REQUIRE(tree.ArenaNum() == 0);
+    REQUIRE(hint->second == 'b');// updates leave the nodes in place
+    REQUIRE(tree.CompactHotVersions() == 1);
+    REQUIRE(tree.ArenaNum() == 1);
+    REQUIRE(version->reads_ == 0);
+    REQUIRE(tree.CompactHotVersions() == 0);
+    REQUIRE(tree.CheckTreeValidAllVersion());
+    tree.SetCompactionThreshold(0, Tree::Clock::duration::zero());
+}
+
+TEST_CASE("sharded tree", "[sharded]")
+{
+    typedef ShardedRedBlackTreeTest<int, int> Sharded;
+    typedef std::pair<int, int> ShardedValue;
+    typedef ShardedRedBlackTree<int, int, CountAggregate> CountedSharded;
+    Sharded sharded({1000, 2000, 3000});
+    CountedSharded counted({10, 20});
+    CountedSharded::Snapshot* counted_snapshot;
+    std::vector<std::thread> writers;
+    std::vector<Sharded::Snapshot*> snapshots;
+    std::vector<std::vector<ShardedValue>> contents;
+    std::vector<ShardedValue> values;
+    std::atomic<bool> writing(true);
+    std::atomic<int> failed_insert_num(0);
+    Sharded::Snapshot* snapshot;
+    std::size_t count;
+    int previous;
+
+    REQUIRE(sharded.ShardNum() == 4);
+    REQUIRE(sharded.ShardOf(999) == 0);
+    REQUIRE(sharded.ShardOf(1000) == 1);
+    REQUIRE(sharded.ShardOf(5000) == 3);
+    snapshot = sharded.Publish();
+    REQUIRE(sharded.CBegin(snapshot) == sharded.CEnd());
+    REQUIRE(sharded.Find(5, snapshot) == sharded.CEnd());
+    REQUIRE_THROWS_AS(sharded.At(5, snapshot), std::out_of_range);
+    sharded.Release(snapshot);
+    REQUIRE(sharded.GetSnapshot(0) == nullptr);
+
+    // a writer per shard, plus a second one sharing shard 3, each inserting in key order
+    for (int shard = 0; shard < 4; ++shard)
+    {
+        writers.emplace_back([&sharded, &failed_insert_num, shard]() {
+            for (int i = 0; i < 500; ++i)
+                if (sharded.Insert({shard * 1000 + i, i}) == false) ++failed_insert_num;
+        });
+    }
+    writers.emplace_back([&sharded, &failed_insert_num]() {
+        for (int i = 0; i < 500; ++i)
+            if (sharded.Insert({3500 + i, i}) == false) ++failed_insert_num;
+    });
+    // meanwhile every snapshot must hold a prefix of each writer's keys
+    std::thread reader([&]() {
+        while (writing)
+        {
+            snapshot = sharded.Publish();
+            values.clear();
+            for (Sharded::ConstIterator it = sharded.CBegin(snapshot); it != sharded.CEnd(); ++it)
+                values.push_back(*it);
+            snapshots.push_back(snapshot);
+            contents.push_back(values);
+        }
+    });
+    for (std::thread& writer : writers) writer.join();
+    writing = false;
+    reader.join();
+    REQUIRE(failed_insert_num == 0);
+
+    for (std::size_t i = 0; i < snapshots.size(); ++i)
+    {
+        previous = -1;
+        for (const ShardedValue& value : contents[i])
+        {
+            REQUIRE(value.first > previous);
+            REQUIRE(value.second == value.first % 500);
+            // a key present means the key before it from the same writer is too
+            if (value.first % 500 != 0) REQUIRE(previous == value.first - 1);
+            previous = value.first;
+        }
+        // later updates do not show through an earlier snapshot
+        values.clear();
+        for (Sharded::ConstIterator it = sharded.CBegin(snapshots[i]); it != sharded.CEnd(); ++it)
+            values.push_back(*it);
+        REQUIRE(values == contents[i]);
+    }
+    snapshot = sharded.Publish();
+    count = 0;
+    for (Sharded::ConstIterator it = sharded.CBegin(snapshot); it != sharded.CEnd(); ++it) ++count;
+    REQUIRE(count == 2500);
+    REQUIRE(sharded.At(3999, snapshot) == 499);
+    REQUIRE(sharded.Find(1250, snapshot)->second == 250);
+    REQUIRE(sharded.Find(1500, snapshot) == sharded.CEnd());
+
+    // deleting a whole shard leaves the others and the snapshot alone
+    for (int i = 0; i < 500; ++i) REQUIRE(sharded.Delete(1000 + i));
+    REQUIRE_FALSE(sharded.Delete(1000));
+    REQUIRE(sharded.Find(1250, snapshot)->second == 250);
+    sharded.Release(snapshot);
+    snapshot = sharded.Publish();
+    REQUIRE(sharded.Find(1250, snapshot) == sharded.CEnd());
+    count = 0;
+    for (Sharded::ConstIterator it = sharded.CBegin(snapshot); it != sharded.CEnd(); ++it) ++count;
+    REQUIRE(count == 2000);
+
+    // once no snapshot holds them, every shard keeps only its latest version
+    for (Sharded::Snapshot* old_snapshot : snapshots) sharded.Release(old_snapshot);
+    REQUIRE(sharded.GetSnapshot(0) == nullptr);
+    for (std::size_t shard = 0; shard < sharded.ShardNum(); ++shard)
+        REQUIRE(sharded.LiveVersionNum(shard) == 1);
+    REQUIRE(sharded.GetSnapshot(snapshot->id()) == snapshot);
+    sharded.Release(snapshot);
+    REQUIRE(sharded.SnapshotNum() == 0);
+    for (std::size_t shard = 0; shard < sharded.ShardNum(); ++shard)
+        REQUIRE(sharded.LiveVersionNum(shard) == 1);
+
+    // aggregates over a range spanning shards
+    for (int i = 0; i < 30; ++i) counted.Insert({i, i});
+    counted_snapshot = counted.Publish();
+    REQUIRE(counted.RangeAggregate(5, 25, counted_snapshot) == 20);
+    REQUIRE(counted.RangeAggregate(12, 18, counted_snapshot) == 6);
+    REQUIRE(counted.RangeAggregate(25, 5, counted_snapshot) == 0);
+    counted.Release(counted_snapshot);
+}
+
+TEST_CASE("page versions out", "[page store]")
+{
+    PageFile file("prbt_page_store_test.bin", 4096);
+    BufferPool pool(file, 8);
+    PageFile small_file("prbt_page_store_test_small.bin", 64);
+    BufferPool small_pool(small_file, 1);
+    Tree tree;
+    PersistentRedBlackTreeTest<int, int, SumAggregate<int>> summed;
+    std::vector<std::map<int, char>> expected;
+    std::vector<NonConstValueType> require_values;
+    std::vector<VersionPtr> versions;
+    std::map<int, char> now;
+    std::mt19937 rng(7);
+    VersionPtr latest, next;
+    std::size_t stored_num, total_size;
+    PageId page;
+    int key;
+
+    tree.SetPageStore(&pool);
+    REQUIRE_THROWS_AS(tree.SetPageStore(&pool), std::logic_error);
+    // 40 kept versions, a few updates apart
+    latest = tree.EmptyVersion();
+    total_size = 0;
+    for (int i = 0; i < 40; ++i)
+    {
+        for (int j = 0; j < (i == 0 ? 400 : 5); ++j)
+        {
+            key = rng() % 1000;
+            if (i == 0 || rng() % 4)
+            {
+                next = tree.InsertOrAssign({key, 'a' + j % 26}, latest).first.version();
+                now[key] = 'a' + j % 26;
+            }
+            else
+            {
+                next = tree.Delete(key, latest).first;
+                now.erase(key);
+            }
+            if (latest != tree.EmptyVersion() && (versions.empty() || latest != versions.back()))
+                tree.RemoveVersion(latest);
+            latest = next;
+        }
+        versions.push_back(latest);
+        expected.push_back(now);
+        total_size += now.size();
+    }
+    // the last version stays resident; the others go out, sharing their records
+    for (int i = 0; i < 39; ++i)
+    {
+        tree.PageOut(versions[i]);
+        REQUIRE_FALSE(versions[i]->is_resident());
+    }
+    REQUIRE(tree.StoredNodeNum() < total_size / 4);
+    REQUIRE(tree.CountDistinctNodes({versions[39]}) == expected[39].size());
+    REQUIRE(tree.CheckStoredVersionsValid());
+    REQUIRE(pool.eviction_num() > 0);
+    stored_num = tree.StoredNodeNum();
+
+    // any use pages a version back in
+    for (int i = 0; i < 40; ++i)
+    {
+        key = expected[i].begin()->first;
+        REQUIRE(tree.At(key, versions[i]) == expected[i].begin()->second);
+        REQUIRE(versions[i]->is_resident());
+        require_values.assign(expected[i].begin(), expected[i].end());
+        REQUIRE(tree.CheckTreeValid(versions[i], require_values));
+    }
+    REQUIRE(tree.CheckTreeValidAllVersion());
+    // the nodes still resident are shared, not read again
+    REQUIRE(tree.CountDistinctNodes(versions) < total_size / 4);
+    // records are kept, so paging out again writes nothing
+    for (int i = 0; i < 39; ++i) tree.PageOut(versions[i]);
+    REQUIRE(tree.StoredNodeNum() == stored_num);
+    REQUIRE(tree.CheckStoredVersionsValid());
+    // also for nodes Compact has moved since they were paged in
+    REQUIRE(tree.At(expected[38].begin()->first, versions[38]) == expected[38].begin()->second);
+    tree.Compact(versions[38]);
+    REQUIRE(tree.ArenaNum() == 1);
+    tree.PageOut(versions[38]);
+    REQUIRE(tree.StoredNodeNum() == stored_num);
+    REQUIRE(tree.ArenaNum() == 0);
+
+    // updates derive from a paged-out version
+    next = tree.Insert({-5, 'z'}, versions[3]).first.version();
+    require_values.assign(expected[3].begin(), expected[3].end());
+    require_values.insert(require_values.begin(), {-5, 'z'});
+    REQUIRE(tree.CheckTreeValid(next, require_values));
+    tree.RemoveVersion(next);
+    next = tree.Delete(expected[5].begin()->first, versions[5]).first;
+    require_values.assign(std::next(expected[5].begin()), expected[5].end());
+    REQUIRE(tree.CheckTreeValid(next, require_values));
+    tree.RemoveVersion(next);
+
+    // removing the versions frees their records
+    for (int i = 0; i < 39; ++i) tree.RemoveVersion(versions[i]);
+    REQUIRE(tree.StoredNodeNum() == 0);
+    REQUIRE(tree.CheckTreeValidAllVersion());
+
+    // aggregates are rebuilt when paging in; a second tree shares the pool
+    summed.SetPageStore(&pool);
+    for (int i = 0; i < 300; ++i) summed.Insert({i, i});
+    summed.PageOut(summed.GetVersion(300));
+    REQUIRE(summed.StoredNodeNum() == 300);
+    REQUIRE(summed.CheckStoredVersionsValid());
+    REQUIRE(summed.RangeAggregate(100, 200, summed.GetVersion(300)) == 14950);
+    REQUIRE(summed.CheckTreeValidAllVersion());
+
+    // counters of the pool, and a pool whose frames are all pinned
+    pool.ResetCounters();
+    REQUIRE(pool.HitRate() == 0);
+    page = pool.Allocate();
+    pool.Pin(page)[0] = 'x';
+    pool.Unpin(page, true);
+    REQUIRE(pool.Pin(page)[0] == 'x');
+    REQUIRE(pool.hit_num() == 2);
+    REQUIRE(pool.HitRate() == 1);
+    for (int i = 0; i < 7; ++i) pool.Pin(pool.Allocate());
+    REQUIRE_THROWS_AS(pool.Allocate(), std::runtime_error);
+    // and the failed call took no page from the file
+    small_pool.Pin(small_pool.Allocate());
+    REQUIRE_THROWS_AS(small_pool.Allocate(), std::runtime_error);
+    REQUIRE(small_file.page_num() == 1);
+    std::remove("prbt_page_store_test.bin");
+    std::remove("prbt_page_store_test_small.bin");
+}
+
+TEST_CASE("export columns and scan them", "[columns]")
+{
+    PersistentRedBlackTree<int, int> tree;
+    PersistentRedBlackTree<int, int>::Version* version;
+    std::map<int, int> expected;
+    std::vector<int> keys, values, chunk_sizes;
+    std::vector<std::size_t> selection, expected_selection;
+    std::mt19937 rng(11);
+    ColumnAggregate<int, int, long long> by_key(1000, 50000), none(5, 5);
+    ColumnAggregate<int, int, long long> streamed(1000, 50000);
+    long long sum;
+    std::size_t count;
+    int key, value, minimum, maximum;
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        key = rng() % 100000;
+        value = int(rng() % 2001) - 1000;
+        tree.InsertOrAssign({key, value});
+        expected[key] = value;
+    }
+    version = tree.GetVersion(10000);
+    tree.ExportColumns(version, keys, values);
+    REQUIRE(keys.size() == expected.size());
+    count = 0;
+    for (const std::pair<const int, int>& element : expected)
+    {
+        REQUIRE(keys[count] == element.first);
+        REQUIRE(values[count] == element.second);
+        ++count;
+    }
+    // chunks come in order and are full except the last
+    count = 0;
+    tree.ExportColumns(version, [&](const int* key_chunk, const int* value_chunk, std::size_t size) {
+        chunk_sizes.push_back(int(size));
+        REQUIRE(std::equal(key_chunk, key_chunk + size, keys.begin() + count));
+        REQUIRE(std::equal(value_chunk, value_chunk + size, values.begin() + count));
+        streamed.Add(key_chunk, value_chunk, size);
+        count += size;
+    }, 1000);
+    REQUIRE(count == keys.size());
+    REQUIRE(chunk_sizes.size() == (keys.size() + 999) / 1000);
+    REQUIRE(chunk_sizes.front() == 1000);
+    REQUIRE_THROWS_AS(tree.ExportColumns(version, [](const int*, const int*, std::size_t) {}, 0),
+        std::invalid_argument);
+
+    // filter on the keys, aggregate the values
+    by_key.Add(keys.data(), values.data(), keys.size());
+    none.Add(keys.data(), values.data(), keys.size());
+    sum = 0;
+    count = 0;
+    minimum = std::numeric_limits<int>::max();
+    maximum = std::numeric_limits<int>::lowest();
+    for (std::size_t i = 0; i < keys.size(); ++i)
+    {
+        if (keys[i] < 1000 || keys[i] >= 50000) continue;
+        sum += values[i];
+        ++count;
+        minimum = std::min(minimum, values[i]);
+        maximum = std::max(maximum, values[i]);
+        expected_selection.push_back(i);
+    }
+    REQUIRE(by_key.count() == count);
+    REQUIRE(by_key.sum() == sum);
+    REQUIRE(by_key.min() == minimum);
+    REQUIRE(by_key.max() == maximum);
+    REQUIRE(streamed.count() == count);
+    REQUIRE(streamed.sum() == sum);
+    REQUIRE(streamed.min() == minimum);
+    REQUIRE(none.count() == 0);
+    REQUIRE(none.sum() == 0);
+    REQUIRE(none.min() == std::numeric_limits<int>::max());
+    REQUIRE(none.max() == std::numeric_limits<int>::lowest());
+    SelectInRange(keys.data(), keys.size(), 1000, 50000, selection);
+    REQUIRE(selection == expected_selection);
+
+    // an empty version exports nothing
+    keys.clear();
+    values.clear();
+    version = tree.Delete(tree.Min(tree.GetVersion(1))->first, tree.GetVersion(1)).first;
+    tree.ExportColumns(version, keys, values);
+    REQUIRE(keys.empty());
+    REQUIRE(values.empty());
+
+    // bool values, which a std::vector packs into bits
+    PersistentRedBlackTree<int, bool> flags;
+    std::vector<int> flag_keys;
+    std::vector<bool> flag_values;
+    for (int i = 0; i < 100; ++i) flags.Insert({i, i % 3 == 0});
+    flags.ExportColumns(flags.GetVersion(100), flag_keys, flag_values);
+    REQUIRE(flag_keys.size() == 100);
+    for (int i = 0; i < 100; ++i)
+    {
+        REQUIRE(flag_keys[i] == i);
+        REQUIRE(flag_values[i] == (i % 3 == 0));
+    }
+}
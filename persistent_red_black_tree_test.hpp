@@ -4,10 +4,14 @@
 #define PRBT_TESTING
 
 #include "persistent_red_black_tree.hpp"
+#include "sharded_red_black_tree.hpp"
+#include "column_scan.hpp"
 
 #include <iostream>
 #include <vector>
 #include <list>
+#include <set>
+#include <random>
 
 #define OUT_RESET   "\033[0m"
 #define OUT_BLACK   "\033[30m"      /* Black */
@@ -27,11 +31,11 @@
 #define OUT_BOLDCYAN    "\033[1m\033[36m"      /* Bold Cyan */
 #define OUT_BOLDWHITE   "\033[1m\033[37m"      /* Bold White */
 
-template <class Key, class T>
-class PersistentRedBlackTreeTest : public PersistentRedBlackTree<Key, T>
+template <class Key, class T, class Monoid = NoAggregate, bool kMulti = false>
+class PersistentRedBlackTreeTest : public PersistentRedBlackTree<Key, T, Monoid, kMulti>
 {
 public:
-    typedef PersistentRedBlackTree<Key, T> Tree;
+    typedef PersistentRedBlackTree<Key, T, Monoid, kMulti> Tree;
     typedef typename Tree::Node Node;
     typedef typename Tree::Version* VersionPtr;
     typedef typename Tree::ConstIterator CIterator;
@@ -52,10 +56,52 @@ public:
         return left_black_node_num + ((subtree_root->color == Node::BLACK) ? 1 : 0);
     }
 
+    // the cached minimum and maximum are the ends of the spines
+    bool CheckExtremesValid(VersionPtr version)
+    {
+        Node *leftmost, *rightmost;
+        leftmost = rightmost = version->root_;
+        while (leftmost != this->nil_ && leftmost->left != this->nil_) leftmost = leftmost->left;
+        while (rightmost != this->nil_ && rightmost->right != this->nil_) rightmost = rightmost->right;
+        return version->leftmost_ == leftmost && version->rightmost_ == rightmost;
+    }
+
+    std::size_t LiveIdLevelNum() { return this->live_ids_.size(); }
+
+    // each level of the live id bitmap summarizes the one below, and the search
+    // for the last existing version finds the same one as a scan back from each id
+    bool CheckLiveIdsValid()
+    {
+        std::size_t level, i;
+        VersionPtr last;
+        for (level = 0; level + 1 < this->live_ids_.size(); ++level)
+        {
+            if (this->live_ids_[level + 1].size() != (this->live_ids_[level].size() + 63) / 64) return false;
+            for (i = 0; i < this->live_ids_[level].size(); ++i)
+                if ((this->live_ids_[level][i] != 0) != ((this->live_ids_[level + 1][i / 64] >> (i % 64) & 1) != 0)) return false;
+        }
+        if (this->live_ids_.back().size() != 1) return false;
+        last = nullptr;
+        for (i = 0; i < this->versions_.size(); ++i)
+        {
+            if (((this->live_ids_[0][i / 64] >> (i % 64) & 1) != 0) != (this->versions_[i] != nullptr)) return false;
+            if (this->versions_[i] != nullptr) last = this->versions_[i];
+            if (this->LiveVersionAtOrBefore(i) != last) return false;
+        }
+        return true;
+    }
+
+    // keys ascend, strictly unless equal keys are allowed
+    static bool KeysInOrder(const Key& last, const Key& next)
+    {
+        return kMulti ? !(next < last) : last < next;
+    }
+
     bool CheckTreeValid(VersionPtr version)
     {
         CIterator it, it_last;
         if (CheckRBSubtreeValid(version->root_) == -1) return false;
+        if (CheckExtremesValid(version) == false) return false;
         it = this->CBegin(version);
         if (it != this->CEnd())
         {
@@ -63,7 +109,7 @@ public:
             ++it;
             while (it != this->CEnd())
             {
-                if (it_last->first >= it->first) return false;
+                if (KeysInOrder(it_last->first, it->first) == false) return false;
                 it_last = it;
                 ++it;
             }
@@ -76,6 +122,7 @@ public:
         size_t require_values_index;
         CIterator it, it_last;
         if (CheckRBSubtreeValid(version->root_) == -1) return false;
+        if (CheckExtremesValid(version) == false) return false;
         it = this->CBegin(version);
         require_values_index = 0;
         if (it != this->CEnd())
@@ -92,7 +139,7 @@ public:
                     require_values[require_values_index].second != it->second) 
                     return false;
                 ++require_values_index;
-                if (it_last->first >= it->first) return false;
+                if (KeysInOrder(it_last->first, it->first) == false) return false;
                 it_last = it;
                 ++it;
             }
@@ -101,16 +148,169 @@ public:
         return true;
     }
 
+    // contents is any container of key-value pairs in key order, e.g. a std::map
+    template <class Contents>
+    bool CheckTreeValid(VersionPtr version, const Contents& contents)
+    {
+        return CheckTreeValid(version, std::vector<NonConstValueType>(contents.begin(), contents.end()));
+    }
+
+    // a random walk over versions, kept in versions along with the contents each should
+    // have: step_num times, step(i, dependent version, its contents) derives versions from
+    // a random kept one (the empty version while none is kept) and appends them with their
+    // contents (step takes them by value, as appending may move them), then random
+    // versions are removed while more than max_version_num are kept.
+    // Every version a step appends, and every version kept at the end, is checked with
+    // CheckTreeValid; returns false at the first invalid one
+    template <class Contents, class Step>
+    bool RandomVersionWalk(std::vector<std::pair<VersionPtr, Contents>>& versions, std::mt19937& rng,
+        int step_num, size_t max_version_num, Step step)
+    {
+        size_t index, version_num;
+        int i;
+        for (i = 0; i < step_num; ++i)
+        {
+            version_num = versions.size();
+            if (versions.empty())
+            {
+                step(i, this->version_nil_, Contents());
+            }
+            else
+            {
+                index = rng() % versions.size();
+                step(i, versions[index].first, versions[index].second);
+            }
+            for (index = version_num; index < versions.size(); ++index)
+            {
+                if (CheckTreeValid(versions[index].first, versions[index].second) == false) return false;
+            }
+            while (versions.size() > max_version_num)
+            {
+                index = rng() % versions.size();
+                this->RemoveVersion(versions[index].first);
+                versions.erase(versions.begin() + index);
+            }
+        }
+        for (auto& version : versions)
+        {
+            if (CheckTreeValid(version.first, version.second) == false) return false;
+        }
+        return true;
+    }
+
+    // number of nodes used only by version (not shared with any other version)
+    size_t CountOwnedNodes(const Node* subtree_root)
+    {
+        if (subtree_root == this->nil_ || subtree_root->use_count > 0) return 0;
+        return 1 + CountOwnedNodes(subtree_root->left) + CountOwnedNodes(subtree_root->right);
+    }
+
+    // number of nodes reachable from any of versions
+    size_t CountDistinctNodes(const std::vector<VersionPtr>& versions)
+    {
+        std::set<const Node*> nodes;
+        std::vector<const Node*> todo;
+        const Node* node;
+        for (VersionPtr version : versions) todo.push_back(version->root_);
+        while (todo.empty() == false)
+        {
+            node = todo.back();
+            todo.pop_back();
+            if (node == this->nil_ || nodes.insert(node).second == false) continue;
+            todo.push_back(node->left);
+            todo.push_back(node->right);
+        }
+        return nodes.size();
+    }
+
+    // nodes of the subtree which other versions use too, in preorder
+    void CollectSharedNodes(const Node* subtree_root, std::vector<const Node*>& nodes)
+    {
+        if (subtree_root == this->nil_) return;
+        if (subtree_root->use_count > 0) nodes.push_back(subtree_root);
+        CollectSharedNodes(subtree_root->left, nodes);
+        CollectSharedNodes(subtree_root->right, nodes);
+    }
+
+    // span of the addresses of the nodes used only by the version of subtree_root
+    void BoundOwnedNodes(const Node* subtree_root, uintptr_t& lowest, uintptr_t& highest)
+    {
+        if (subtree_root == this->nil_ || subtree_root->use_count > 0) return;
+        lowest = std::min(lowest, reinterpret_cast<uintptr_t>(subtree_root));
+        highest = std::max(highest, reinterpret_cast<uintptr_t>(subtree_root));
+        BoundOwnedNodes(subtree_root->left, lowest, highest);
+        BoundOwnedNodes(subtree_root->right, lowest, highest);
+    }
+
+    size_t ArenaNum()
+    {
+        return this->arenas_.size();
+    }
+
+    // records in the page store
+    size_t StoredNodeNum()
+    {
+        return this->stored_use_counts_.size() - 1 - this->free_stored_ids_.size();
+    }
+
+    VersionPtr EmptyVersion()
+    {
+        return this->version_nil_;
+    }
+
+    // pages in the versions that are out
     bool CheckTreeValidAllVersion()
     {        
         VersionPtr now;
         for (now = this->version_nil_->next_; now != this->version_nil_; now = now->next_)
         {
+            this->MakeResident(now);
             if (CheckTreeValid(now) == false) return false;
         }
         return true;
     }
 
+    // the records PageOut wrote for each version form a valid red-black tree in key
+    // order, read from the page store without paging any version in
+    bool CheckStoredVersionsValid()
+    {
+        VersionPtr now;
+        for (now = this->version_nil_->next_; now != this->version_nil_; now = now->next_)
+        {
+            if (now->stored_root_ == Tree::kNilStoredNodeId)
+            {
+                if (now->is_resident() == false) return false;
+            }
+            else if (CheckStoredSubtreeValid(now->stored_root_, nullptr, nullptr, false) == -1)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // CheckRBSubtreeValid for the records below id, whose keys must lie between
+    // lower and upper (nullptr if unbounded)
+    int CheckStoredSubtreeValid(typename Tree::StoredNodeId id, const Key* lower, const Key* upper, bool is_parent_red)
+    {
+        typename Tree::StoredNode stored;
+        const Key* key;
+        int left_black_node_num, right_black_node_num;
+        if (id == Tree::kNilStoredNodeId) return 1;
+        if (this->stored_use_counts_[id] == 0) return -1;
+        this->ReadStored(id, stored);
+        key = reinterpret_cast<const Key*>(stored.key);
+        if ((lower != nullptr && KeysInOrder(*lower, *key) == false) ||
+            (upper != nullptr && KeysInOrder(*key, *upper) == false))
+            return -1;
+        if (stored.color == Node::RED && is_parent_red) return -1;
+        left_black_node_num = CheckStoredSubtreeValid(stored.left, lower, key, stored.color == Node::RED);
+        right_black_node_num = CheckStoredSubtreeValid(stored.right, key, upper, stored.color == Node::RED);
+        if (left_black_node_num == -1 || right_black_node_num == -1 || left_black_node_num != right_black_node_num)
+            return -1;
+        return left_black_node_num + ((stored.color == Node::BLACK) ? 1 : 0);
+    }
+
     void PrintNode(Node* node)
     {
         if (node->color == Node::RED) std::cout << OUT_RED;
@@ -161,4 +361,26 @@ public:
 
 };
 
+template <class Key, class T>
+class ShardedRedBlackTreeTest : public ShardedRedBlackTree<Key, T>
+{
+public:
+    explicit ShardedRedBlackTreeTest(const std::vector<Key>& boundaries) : ShardedRedBlackTree<Key, T>(boundaries) {}
+    // versions the tree of shard still keeps
+    std::size_t LiveVersionNum(std::size_t shard)
+    {
+        std::size_t version_num, id;
+        if (this->shards_[shard]->head == nullptr) return 0;
+        version_num = 0;
+        for (id = 1; id <= this->shards_[shard]->head->id(); ++id)
+            if (this->shards_[shard]->tree.GetVersion(id) != nullptr) ++version_num;
+        return version_num;
+    }
+    // snapshots published and not released yet
+    std::size_t SnapshotNum()
+    {
+        return this->snapshots_.size();
+    }
+};
+
 #endif
@@ -0,0 +1,320 @@
+#ifndef _SHARDED_RED_BLACK_TREE_HPP
+#define _SHARDED_RED_BLACK_TREE_HPP
+
+#include <utility>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "persistent_red_black_tree.hpp"
+
+// ---------- declaration ----------
+
+// the key range cut at boundaries into independent PersistentRedBlackTree shards;
+// updates of different shards run in parallel, each shard under its own mutex.
+// Publish takes a consistent cut of the latest version of every shard as one
+// snapshot; a snapshot may be read by any number of threads while updates go on,
+// until it is released. A shard keeps only its latest version and the versions
+// some snapshot holds.
+template <class Key, class T, class Monoid = NoAggregate, bool kMulti = false>
+class ShardedRedBlackTree
+{
+public:
+    typedef PersistentRedBlackTree<Key, T, Monoid, kMulti> Tree;
+    typedef typename Tree::ValueType ValueType;
+    typedef typename Tree::AggregateType AggregateType;
+    typedef typename Tree::Version ShardVersion;
+    typedef std::size_t SnapshotId;
+
+#ifdef PRBT_TESTING
+protected:
+#else
+private:
+#endif
+    struct Shard
+    {
+        Tree tree;
+        std::mutex mutex;
+        ShardVersion* head;// latest version; nullptr until the first update
+        std::unordered_map<ShardVersion*, std::size_t> pins;// snapshots holding each version
+        Shard() : head(nullptr) {}
+    };
+public:
+    class Snapshot
+    {
+    public:
+        SnapshotId id() const { return id_; }
+        // nullptr if the shard had never been updated
+        ShardVersion* shard_version(std::size_t shard) const { return shard_versions_[shard]; }
+    #ifdef PRBT_TESTING
+    public:
+    #else
+    private:
+    #endif
+        friend class ShardedRedBlackTree<Key, T, Monoid, kMulti>;
+        SnapshotId id_;// monotonically increasing, never reused
+        std::vector<ShardVersion*> shard_versions_;
+    };
+    // visits the shards in key order
+    class ConstIterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef ValueType value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef ValueType* pointer;
+        typedef ValueType& reference;
+        ConstIterator& operator++() { ++it_; SkipEmptyShards(); return *this; }
+        const ValueType& operator*() const { return *it_; }
+        const ValueType* operator->() const { return &(*it_); }
+        bool operator==(const ConstIterator& other) const { return shard_ == other.shard_ && it_ == other.it_; }
+        bool operator!=(const ConstIterator& other) const { return !(*this == other); }
+        ConstIterator() : container_(nullptr), snapshot_(nullptr), shard_(0) {}
+    private:
+        friend class ShardedRedBlackTree<Key, T, Monoid, kMulti>;
+        ConstIterator(ShardedRedBlackTree* container, const Snapshot* snapshot, std::size_t shard,
+            typename Tree::ConstIterator it) : container_(container), snapshot_(snapshot), shard_(shard), it_(it) {}
+        void SkipEmptyShards();
+        ShardedRedBlackTree* container_;
+        const Snapshot* snapshot_;
+        std::size_t shard_;
+        typename Tree::ConstIterator it_;
+    };
+
+    // shard i holds the keys in [boundaries[i - 1], boundaries[i]); boundaries must be sorted
+    explicit ShardedRedBlackTree(const std::vector<Key>& boundaries);
+    ~ShardedRedBlackTree();
+    ShardedRedBlackTree(const ShardedRedBlackTree&) = delete;
+    ShardedRedBlackTree& operator=(const ShardedRedBlackTree&) = delete;
+    // updates of the latest version of the key's shard; safe to call from any thread
+    bool Insert(const ValueType& value);
+    bool InsertOrAssign(const ValueType& value);
+    bool Delete(const Key& key);
+    // consistent cut of the latest versions of all shards; valid until released
+    Snapshot* Publish();
+    void Release(Snapshot* snapshot);
+    // nullptr if released or never published
+    Snapshot* GetSnapshot(SnapshotId id);
+    // reads of a snapshot; safe to call from any thread
+    const T& At(const Key& key, const Snapshot* snapshot);
+    ConstIterator Find(const Key& key, const Snapshot* snapshot);
+    // aggregate of the values whose keys are in [lower, upper)
+    AggregateType RangeAggregate(const Key& lower, const Key& upper, const Snapshot* snapshot);
+    ConstIterator CBegin(const Snapshot* snapshot);
+    ConstIterator CEnd();
+    std::size_t ShardNum() const { return shards_.size(); }
+    std::size_t ShardOf(const Key& key) const;
+
+#ifdef PRBT_TESTING
+protected:
+#else
+private:
+#endif
+    void Advance(Shard& shard, ShardVersion* new_head);
+    typename Tree::ConstIterator ShardBegin(std::size_t shard, const Snapshot* snapshot);
+
+    std::vector<Key> boundaries_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex snapshots_mutex_;// guards snapshots_ and next_snapshot_id_
+    std::unordered_map<SnapshotId, Snapshot*> snapshots_;// unreleased ones; erased on release
+    SnapshotId next_snapshot_id_;
+};
+
+// ---------- definition ----------
+
+template <class Key, class T, class Monoid, bool kMulti>
+ShardedRedBlackTree<Key, T, Monoid, kMulti>::ShardedRedBlackTree(const std::vector<Key>& boundaries)
+    : boundaries_(boundaries), next_snapshot_id_(0)
+{
+    std::size_t i;
+    for (i = 0; i <= boundaries_.size(); ++i) shards_.emplace_back(new Shard());
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+ShardedRedBlackTree<Key, T, Monoid, kMulti>::~ShardedRedBlackTree()
+{
+    for (auto& snapshot : snapshots_) delete snapshot.second;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+std::size_t ShardedRedBlackTree<Key, T, Monoid, kMulti>::ShardOf(const Key& key) const
+{
+    return std::upper_bound(boundaries_.begin(), boundaries_.end(), key) - boundaries_.begin();
+}
+
+// make new_head the latest version of shard, whose mutex the caller holds;
+// the previous latest version goes unless a snapshot holds it
+template <class Key, class T, class Monoid, bool kMulti>
+void ShardedRedBlackTree<Key, T, Monoid, kMulti>::Advance(Shard& shard, ShardVersion* new_head)
+{
+    if (shard.head != nullptr && shard.pins.count(shard.head) == 0) shard.tree.RemoveVersion(shard.head);
+    shard.head = new_head;
+}
+
+// the tree's own latest version is always shard.head, which the updates below derive from
+template <class Key, class T, class Monoid, bool kMulti>
+bool ShardedRedBlackTree<Key, T, Monoid, kMulti>::Insert(const ValueType& value)
+{
+    Shard& shard = *shards_[ShardOf(ValueTraits<Key, T>::KeyOf(value))];
+    std::pair<typename Tree::ConstIterator, bool> insert_result;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    insert_result = shard.tree.Insert(value);
+    Advance(shard, insert_result.first.version());
+    return insert_result.second;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+bool ShardedRedBlackTree<Key, T, Monoid, kMulti>::InsertOrAssign(const ValueType& value)
+{
+    Shard& shard = *shards_[ShardOf(ValueTraits<Key, T>::KeyOf(value))];
+    std::pair<typename Tree::ConstIterator, bool> insert_result;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    insert_result = shard.tree.InsertOrAssign(value);
+    Advance(shard, insert_result.first.version());
+    return insert_result.second;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+bool ShardedRedBlackTree<Key, T, Monoid, kMulti>::Delete(const Key& key)
+{
+    Shard& shard = *shards_[ShardOf(key)];
+    std::pair<ShardVersion*, bool> delete_result;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    delete_result = shard.tree.Delete(key);
+    Advance(shard, delete_result.first);
+    return delete_result.second;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename ShardedRedBlackTree<Key, T, Monoid, kMulti>::Snapshot* ShardedRedBlackTree<Key, T, Monoid, kMulti>::Publish()
+{
+    Snapshot* snapshot;
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::size_t i;
+    snapshot = new Snapshot();
+    snapshot->shard_versions_.resize(shards_.size());
+    // every shard is locked at once, in index order, so the cut is consistent;
+    // an update holds a single shard's mutex, so this cannot deadlock
+    for (i = 0; i < shards_.size(); ++i) locks.emplace_back(shards_[i]->mutex);
+    for (i = 0; i < shards_.size(); ++i)
+    {
+        snapshot->shard_versions_[i] = shards_[i]->head;
+        if (shards_[i]->head != nullptr) ++shards_[i]->pins[shards_[i]->head];
+    }
+    locks.clear();
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    snapshot->id_ = next_snapshot_id_++;
+    snapshots_.emplace(snapshot->id_, snapshot);
+    return snapshot;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+void ShardedRedBlackTree<Key, T, Monoid, kMulti>::Release(Snapshot* snapshot)
+{
+    ShardVersion* version;
+    std::size_t i;
+    {
+        std::lock_guard<std::mutex> lock(snapshots_mutex_);
+        snapshots_.erase(snapshot->id_);
+    }
+    for (i = 0; i < shards_.size(); ++i)
+    {
+        version = snapshot->shard_versions_[i];
+        if (version == nullptr) continue;
+        Shard& shard = *shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (--shard.pins[version] > 0) continue;
+        shard.pins.erase(version);
+        if (version != shard.head) shard.tree.RemoveVersion(version);
+    }
+    delete snapshot;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename ShardedRedBlackTree<Key, T, Monoid, kMulti>::Snapshot* ShardedRedBlackTree<Key, T, Monoid, kMulti>::GetSnapshot
+    (SnapshotId id)
+{
+    typename std::unordered_map<SnapshotId, Snapshot*>::iterator it;
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    it = snapshots_.find(id);
+    return it == snapshots_.end() ? nullptr : it->second;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+const T& ShardedRedBlackTree<Key, T, Monoid, kMulti>::At(const Key& key, const Snapshot* snapshot)
+{
+    std::size_t shard;
+    shard = ShardOf(key);
+    if (snapshot->shard_versions_[shard] == nullptr)
+        throw std::out_of_range("the container does not have an element with the specified key");
+    return shards_[shard]->tree.At(key, snapshot->shard_versions_[shard]);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename ShardedRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator ShardedRedBlackTree<Key, T, Monoid, kMulti>::Find
+    (const Key& key, const Snapshot* snapshot)
+{
+    typename Tree::ConstIterator it;
+    std::size_t shard;
+    shard = ShardOf(key);
+    if (snapshot->shard_versions_[shard] == nullptr) return CEnd();
+    it = shards_[shard]->tree.Find(key, snapshot->shard_versions_[shard]);
+    if (it == shards_[shard]->tree.CEnd()) return CEnd();
+    return ConstIterator(this, snapshot, shard, it);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename ShardedRedBlackTree<Key, T, Monoid, kMulti>::AggregateType ShardedRedBlackTree<Key, T, Monoid, kMulti>::RangeAggregate
+    (const Key& lower, const Key& upper, const Snapshot* snapshot)
+{
+    AggregateType aggregate;
+    std::size_t shard, last;
+    aggregate = Monoid::Identity();
+    last = ShardOf(upper);
+    // only the shards overlapping the range, combined in key order
+    for (shard = ShardOf(lower); shard <= last; ++shard)
+    {
+        if (snapshot->shard_versions_[shard] == nullptr) continue;
+        aggregate = Monoid::Combine(aggregate,
+            shards_[shard]->tree.RangeAggregate(lower, upper, snapshot->shard_versions_[shard]));
+    }
+    return aggregate;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename ShardedRedBlackTree<Key, T, Monoid, kMulti>::Tree::ConstIterator ShardedRedBlackTree<Key, T, Monoid, kMulti>::ShardBegin
+    (std::size_t shard, const Snapshot* snapshot)
+{
+    if (snapshot->shard_versions_[shard] == nullptr) return shards_[shard]->tree.CEnd();
+    return shards_[shard]->tree.CBegin(snapshot->shard_versions_[shard]);
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename ShardedRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator ShardedRedBlackTree<Key, T, Monoid, kMulti>::CBegin
+    (const Snapshot* snapshot)
+{
+    ConstIterator it(this, snapshot, 0, ShardBegin(0, snapshot));
+    it.SkipEmptyShards();
+    return it;
+}
+
+template <class Key, class T, class Monoid, bool kMulti>
+typename ShardedRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator ShardedRedBlackTree<Key, T, Monoid, kMulti>::CEnd()
+{
+    return ConstIterator(this, nullptr, shards_.size() - 1, shards_.back()->tree.CEnd());
+}
+
+// past the end of a shard, move to the first element of the next nonempty one
+template <class Key, class T, class Monoid, bool kMulti>
+void ShardedRedBlackTree<Key, T, Monoid, kMulti>::ConstIterator::SkipEmptyShards()
+{
+    while (it_ == container_->shards_[shard_]->tree.CEnd() && shard_ + 1 < container_->shards_.size())
+    {
+        ++shard_;
+        it_ = container_->ShardBegin(shard_, snapshot_);
+    }
+}
+
+#endif
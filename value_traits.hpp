@@ -0,0 +1,68 @@
+#ifndef _VALUE_TRAITS_HPP
+#define _VALUE_TRAITS_HPP
+
+#include <utility>
+#include <cstdint>
+
+// mapped type of a set: nodes store the key alone
+struct SetMapped
+{
+    bool operator==(const SetMapped&) const { return true; }
+};
+
+// how a node stores its element; a map stores std::pair<const Key, T>
+template <class Key, class T>
+struct ValueTraits
+{
+    typedef std::pair<const Key, T> ValueType;
+    static const Key& KeyOf(const ValueType& value) { return value.first; }
+    static const T& MappedOf(const ValueType& value) { return value.second; }
+    static ValueType MakeValue(const Key& key, const T& mapped) { return ValueType(key, mapped); }
+    static void AssignMapped(ValueType& value, const ValueType& source) { value.second = source.second; }
+    // also overwrites the key; only for a node used by no other version
+    static void Assign(ValueType& value, const ValueType& source)
+    {
+        const_cast<Key&>(value.first) = source.first;
+        value.second = source.second;
+    }
+};
+
+// a set stores the key alone
+template <class Key>
+struct ValueTraits<Key, SetMapped>
+{
+    typedef Key ValueType;
+    static const Key& KeyOf(const ValueType& value) { return value; }
+    static const SetMapped& MappedOf(const ValueType&)
+    {
+        static const SetMapped mapped;
+        return mapped;
+    }
+    static ValueType MakeValue(const Key& key, const SetMapped&) { return key; }
+    static void AssignMapped(ValueType&, const ValueType&) {}
+    static void Assign(ValueType& value, const ValueType& source) { value = source; }
+};
+
+// base of a node of a container with duplicate keys: equal keys are kept in
+// insertion order, so (key, sequence) orders the nodes
+template <bool kMulti>
+struct InsertionOrder
+{
+    std::uint64_t sequence;
+    void Stamp(std::uint64_t& next_sequence) { sequence = next_sequence++; }
+    bool Precedes(const InsertionOrder& other) const { return sequence < other.sequence; }
+    std::uint64_t Sequence() const { return sequence; }
+    void RestoreSequence(std::uint64_t stored_sequence) { sequence = stored_sequence; }
+};
+
+// empty base, so that nodes with unique keys do not grow
+template <>
+struct InsertionOrder<false>
+{
+    void Stamp(std::uint64_t&) {}
+    bool Precedes(const InsertionOrder&) const { return false; }
+    std::uint64_t Sequence() const { return 0; }
+    void RestoreSequence(std::uint64_t) {}
+};
+
+#endif